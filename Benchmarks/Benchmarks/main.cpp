@@ -0,0 +1,449 @@
+// Microbenchmarks for both flavors against a loopback HTTP server in the same process, so results only depend on
+// the machine and the library. Prints one JSON document; pass a path to write it there instead, and compare the
+// documents from two commits to see what a change to send or read did.
+//
+//   Benchmarks.exe [output.json] [requests]
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+
+#undef _HAS_EXCEPTIONS
+#define _HAS_EXCEPTIONS 1
+
+#include "../../http_stl.h"
+#include "../../http_nostl.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+	// Counting allocator hook: operator new below only counts on the thread that is being measured, so the
+	// server threads and WinHTTP's own heap use stay out of the numbers.
+	__declspec(thread) bool counting = false;
+	__declspec(thread) unsigned long long allocations = 0;
+	__declspec(thread) unsigned long long allocated_bytes = 0;
+
+	struct allocation_scope_t
+	{
+		allocation_scope_t() : allocations_at_start(allocations), bytes_at_start(allocated_bytes) { counting = true; }
+		~allocation_scope_t() { counting = false; }
+		inline unsigned long long count() const { return allocations - allocations_at_start; }
+		inline unsigned long long bytes() const { return allocated_bytes - bytes_at_start; }
+
+		unsigned long long allocations_at_start;
+		unsigned long long bytes_at_start;
+	};
+
+	void *counted_allocate(size_t size)
+	{
+		if(counting) {
+			++allocations;
+			allocated_bytes += size;
+		}
+		void *p = malloc(size > 0 ? size : 1);
+		if(p == nullptr) {
+			throw std::bad_alloc();
+		}
+		return p;
+	}
+}
+
+void *operator new(size_t size) { return counted_allocate(size); }
+void *operator new[](size_t size) { return counted_allocate(size); }
+void operator delete(void *p) { free(p); }
+void operator delete[](void *p) { free(p); }
+
+
+namespace
+{
+	static const size_t max_payload = 16 * 1024 * 1024;
+	static const unsigned int header_count = 16;
+	static const unsigned int header_iterations = 20000;
+	static const unsigned int construct_iterations = 50000;
+	static const size_t chunk_sizes[] = { 4 * 1024, 64 * 1024, 1024 * 1024 };
+
+	double ticks_per_microsecond()
+	{
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		return frequency.QuadPart / 1000000.0;
+	}
+
+	static const double tick_rate = ticks_per_microsecond();
+
+	inline long long now_ticks()
+	{
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		return now.QuadPart;
+	}
+
+	inline double elapsed_microseconds(long long since)
+	{
+		return (now_ticks() - since) / tick_rate;
+	}
+
+
+	// Keep-alive HTTP/1.1 server on 127.0.0.1. GET /bytes/<n> answers with n bytes, anything else with none;
+	// request bodies are read and dropped.
+	class loopback_server_t
+	{
+	public:
+		loopback_server_t() : listener_(INVALID_SOCKET), port_(0), payload_(max_payload, 'x')
+		{
+			listener_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+			sockaddr_in address;
+			memset(&address, 0, sizeof(address));
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			int length = sizeof(address);
+			if(listener_ == INVALID_SOCKET || bind(listener_, (sockaddr *)&address, sizeof(address)) != 0 ||
+				listen(listener_, SOMAXCONN) != 0 || getsockname(listener_, (sockaddr *)&address, &length) != 0) {
+				return;
+			}
+			port_ = ntohs(address.sin_port);
+			thread_ = std::thread([this]() { accept_loop(); });
+		}
+
+		~loopback_server_t()
+		{
+			if(listener_ != INVALID_SOCKET) {
+				closesocket(listener_);
+			}
+			if(thread_.joinable()) {
+				thread_.join();
+			}
+
+			// With the accept thread gone no more clients arrive; shutting the sockets down wakes any serve() blocked in recv
+			for(auto iter = std::begin(clients_); iter != std::end(clients_); ++iter) {
+				shutdown(*iter, SD_BOTH);
+			}
+			for(auto iter = std::begin(servers_); iter != std::end(servers_); ++iter) {
+				iter->join();
+			}
+			for(auto iter = std::begin(clients_); iter != std::end(clients_); ++iter) {
+				closesocket(*iter);
+			}
+		}
+
+		inline unsigned short port() const { return port_; }
+
+	private:
+		void accept_loop()
+		{
+			while(true) {
+				SOCKET client = accept(listener_, nullptr, nullptr);
+				if(client == INVALID_SOCKET) {
+					return;
+				}
+				std::lock_guard<std::mutex> lock(mutex_);
+				clients_.push_back(client);
+				servers_.push_back(std::thread([this, client]() { serve(client); }));
+			}
+		}
+
+		void serve(SOCKET client)
+		{
+			std::string pending;
+			char buffer[64 * 1024];
+			while(true) {
+				size_t header_end = pending.find("\r\n\r\n");
+				if(header_end == std::string::npos) {
+					int received = recv(client, buffer, sizeof(buffer), 0);
+					if(received <= 0) {
+						break;
+					}
+					pending.append(buffer, received);
+					continue;
+				}
+
+				size_t content_length = 0;
+				std::string head = pending.substr(0, header_end);
+				std::transform(head.begin(), head.end(), head.begin(), ::tolower);
+				size_t found = head.find("\r\ncontent-length:");
+				if(found != std::string::npos) {
+					content_length = strtoul(head.c_str() + found + 17, nullptr, 10);
+				}
+				while(pending.length() < header_end + 4 + content_length) {
+					int received = recv(client, buffer, sizeof(buffer), 0);
+					if(received <= 0) {
+						shutdown(client, SD_BOTH);
+						return;
+					}
+					pending.append(buffer, received);
+				}
+
+				size_t size = 0;
+				if(head.compare(0, 11, "get /bytes/") == 0) {
+					size = strtoul(head.c_str() + 11, nullptr, 10);
+					size = size < max_payload ? size : max_payload;
+				}
+				pending.erase(0, header_end + 4 + content_length);
+
+				char status[160];
+				int status_length = sprintf_s(status, sizeof(status),
+					"HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %u\r\n\r\n", (unsigned int)size);
+				if(!send_all(client, status, status_length) || !send_all(client, payload_.data(), size)) {
+					break;
+				}
+			}
+			// The destructor closes the socket; closing it here could hand its value to a new client before then
+			shutdown(client, SD_BOTH);
+		}
+
+		static bool send_all(SOCKET s, const char *data, size_t length)
+		{
+			while(length > 0) {
+				int sent = send(s, data, (int)(length < 0x10000000 ? length : 0x10000000), 0);
+				if(sent <= 0) {
+					return false;
+				}
+				data += sent;
+				length -= sent;
+			}
+			return true;
+		}
+
+	private:
+		SOCKET listener_;
+		unsigned short port_;
+		std::string payload_;
+		std::thread thread_;
+		std::mutex mutex_;
+		std::vector<SOCKET> clients_;
+		std::vector<std::thread> servers_;
+	};
+
+
+	class json_writer_t
+	{
+	public:
+		json_writer_t(FILE *out) : out_(out), first_(true) { fprintf(out_, "{\n  \"benchmarks\": ["); }
+		~json_writer_t() { fprintf(out_, "\n  ]\n}\n"); }
+
+		void begin(const char *name, const char *flavor)
+		{
+			fprintf(out_, "%s\n    { \"name\": \"%s\", \"flavor\": \"%s\"", first_ ? "" : ",", name, flavor);
+			first_ = false;
+		}
+		void field(const char *key, double value) { fprintf(out_, ", \"%s\": %.3f", key, value); }
+		void field(const char *key, unsigned long long value) { fprintf(out_, ", \"%s\": %llu", key, value); }
+		void end() { fprintf(out_, " }"); }
+
+	private:
+		FILE *out_;
+		bool first_;
+	};
+
+
+	// Round trips of one small GET on one kept-alive connection
+	struct round_trips_t
+	{
+		round_trips_t() : seconds(0.0), allocations(0), allocated_bytes(0) {}
+		std::vector<double> latencies;
+		double seconds;
+		unsigned long long allocations;
+		unsigned long long allocated_bytes;
+	};
+
+	void report(json_writer_t &json, const char *flavor, round_trips_t &result)
+	{
+		std::vector<double> &latencies = result.latencies;
+		std::sort(latencies.begin(), latencies.end());
+		size_t count = latencies.size();
+		json.begin("get_1k", flavor);
+		json.field("requests", (unsigned long long)count);
+		json.field("requests_per_second", count / result.seconds);
+		json.field("p50_us", latencies[count / 2]);
+		json.field("p90_us", latencies[count * 9 / 10]);
+		json.field("p99_us", latencies[count * 99 / 100]);
+		json.field("max_us", latencies[count - 1]);
+		json.field("allocations_per_request", (double)result.allocations / count);
+		json.field("bytes_allocated_per_request", (double)result.allocated_bytes / count);
+		json.end();
+	}
+
+	template <class Connection, class Request>
+	void round_trips(Connection &conn, unsigned int requests, round_trips_t &result)
+	{
+		char buffer[4096];
+		size_t bytes_read = 0;
+		for(unsigned int i = 0; i < requests / 10; ++i) {
+			// Warm up the connection pool and the allocators before anything is measured
+			Request req("GET", "/bytes/1024");
+			auto resp = conn.send(req);
+			while(resp.read(buffer, sizeof(buffer), &bytes_read) && bytes_read > 0) {}
+		}
+
+		result.latencies.reserve(requests);
+		allocation_scope_t scope;
+		long long started = now_ticks();
+		for(unsigned int i = 0; i < requests; ++i) {
+			long long sent = now_ticks();
+			Request req("GET", "/bytes/1024");
+			auto resp = conn.send(req);
+			while(resp.read(buffer, sizeof(buffer), &bytes_read) && bytes_read > 0) {}
+			result.latencies.push_back(elapsed_microseconds(sent));
+		}
+		result.seconds = elapsed_microseconds(started) / 1000000.0;
+		result.allocations = scope.count();
+		result.allocated_bytes = scope.bytes();
+	}
+
+	template <class Request>
+	void header_add(json_writer_t &json, const char *flavor)
+	{
+		char lines[header_count][64];
+		for(unsigned int i = 0; i < header_count; ++i) {
+			sprintf_s(lines[i], sizeof(lines[i]), "X-Benchmark-%u: a-typical-header-value-%u", i, i);
+		}
+
+		double microseconds = 0.0;
+		unsigned long long count = 0, bytes = 0;
+		for(unsigned int i = 0; i < header_iterations; ++i) {
+			Request req("GET", "/");
+			allocation_scope_t scope;
+			long long started = now_ticks();
+			for(unsigned int h = 0; h < header_count; ++h) {
+				req.add_header(lines[h]);
+			}
+			microseconds += elapsed_microseconds(started);
+			count += scope.count();
+			bytes += scope.bytes();
+		}
+
+		unsigned long long adds = (unsigned long long)header_iterations * header_count;
+		json.begin("add_header", flavor);
+		json.field("ns_per_header", microseconds * 1000.0 / adds);
+		json.field("allocations_per_header", (double)count / adds);
+		json.field("bytes_allocated_per_header", (double)bytes / adds);
+		json.end();
+	}
+
+	// The narrow method and url are widened for WinHTTP when the request is built
+	template <class Request>
+	void transcoding(json_writer_t &json, const char *flavor)
+	{
+		std::string url = "/search?q=";
+		url.append(240, 'w');
+
+		allocation_scope_t scope;
+		long long started = now_ticks();
+		for(unsigned int i = 0; i < construct_iterations; ++i) {
+			Request req("GET", url.c_str());
+		}
+		double microseconds = elapsed_microseconds(started);
+
+		json.begin("request_transcode_256", flavor);
+		json.field("ns_per_request", microseconds * 1000.0 / construct_iterations);
+		json.field("ns_per_character", microseconds * 1000.0 / construct_iterations / (url.length() + 3));
+		json.field("allocations_per_request", (double)scope.count() / construct_iterations);
+		json.end();
+	}
+
+	template <class Connection, class Request>
+	void read_throughput(json_writer_t &json, const char *flavor, Connection &conn)
+	{
+		std::vector<char> buffer(chunk_sizes[sizeof(chunk_sizes) / sizeof(chunk_sizes[0]) - 1]);
+		char path[32];
+		sprintf_s(path, sizeof(path), "/bytes/%u", (unsigned int)max_payload);
+
+		for(size_t c = 0; c < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); ++c) {
+			unsigned long long total = 0;
+			double microseconds = 0.0;
+			for(int repeat = 0; repeat < 4; ++repeat) {
+				Request req("GET", path);
+				auto resp = conn.send(req);
+				size_t bytes_read = 0;
+				long long started = now_ticks();
+				while(resp.read(buffer.data(), chunk_sizes[c], &bytes_read) && bytes_read > 0) {
+					total += bytes_read;
+				}
+				microseconds += elapsed_microseconds(started);
+			}
+
+			json.begin("read_16m", flavor);
+			json.field("chunk_size", (unsigned long long)chunk_sizes[c]);
+			json.field("megabytes_per_second", total / microseconds);
+			json.end();
+		}
+	}
+}
+
+
+int main(int argc, char *argv[])
+{
+	WSADATA wsa;
+	if(WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+		fprintf(stderr, "WSAStartup() failed\n");
+		return 1;
+	}
+
+	int result = 0;
+	{
+		loopback_server_t server;
+		if(server.port() == 0) {
+			fprintf(stderr, "could not listen on the loopback interface\n");
+			WSACleanup();
+			return 1;
+		}
+
+		FILE *out = stdout;
+		if(argc > 1 && fopen_s(&out, argv[1], "w") != 0) {
+			fprintf(stderr, "could not open %s\n", argv[1]);
+			WSACleanup();
+			return 1;
+		}
+		unsigned int requests = argc > 2 ? (unsigned int)strtoul(argv[2], nullptr, 10) : 5000;
+		requests = requests >= 100 ? requests : 100;
+
+		char origin[64];
+		sprintf_s(origin, sizeof(origin), "http://127.0.0.1:%u", (unsigned int)server.port());
+
+		try {
+			json_writer_t json(out);
+
+			{
+				http::stl::session_t sess("Benchmarks");
+				http::stl::connection_t conn(sess, origin);
+				round_trips_t trips;
+				round_trips<http::stl::connection_t, http::stl::request_t>(conn, requests, trips);
+				report(json, "stl", trips);
+				read_throughput<http::stl::connection_t, http::stl::request_t>(json, "stl", conn);
+			}
+			header_add<http::stl::request_t>(json, "stl");
+			transcoding<http::stl::request_t>(json, "stl");
+
+			{
+				http::nostl::session_t sess("Benchmarks");
+				http::nostl::connection_t conn(sess, origin);
+				if(sess.error() != nullptr || conn.error() != nullptr) {
+					throw std::runtime_error("could not open the nostl session");
+				}
+				round_trips_t trips;
+				round_trips<http::nostl::connection_t, http::nostl::request_t>(conn, requests, trips);
+				report(json, "nostl", trips);
+				read_throughput<http::nostl::connection_t, http::nostl::request_t>(json, "nostl", conn);
+			}
+			header_add<http::nostl::request_t>(json, "nostl");
+			transcoding<http::nostl::request_t>(json, "nostl");
+		}
+		catch(const std::exception &e) {
+			fprintf(stderr, "benchmark failed: %s\n", e.what());
+			result = 1;
+		}
+
+		if(out != stdout) {
+			fclose(out);
+		}
+	}
+	WSACleanup();
+	return result;
+}
@@ -8,8 +8,10 @@
 
 #include "../../http_stl.h"
 #include "../../http_nostl.h"
+#include "../../http_core.h"
 
 #include <sstream>
+#include <cstdio>
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 using namespace std;
@@ -37,6 +39,74 @@ namespace Tests
 #endif
 	}
 
+	// Counts allocations, to tell whether a reused request_t had to grow again
+	class counting_resource_t : public http::stl::memory_resource_t
+	{
+	public:
+		counting_resource_t() : allocations(0) {}
+		size_t allocations;
+
+	protected:
+		virtual void *do_allocate(size_t bytes, size_t) { ++allocations; return ::operator new(bytes); }
+		virtual void do_deallocate(void *p, size_t, size_t) { ::operator delete(p); }
+	};
+
+	// Writes a one-exchange log in the layout replay_t records, so the stl layer can be exercised without a network
+	std::string WriteReplay(const char *name, const std::string &key, int status, const std::string &headers, const std::string &body)
+	{
+		char directory[MAX_PATH];
+		GetTempPathA(MAX_PATH, directory);
+		std::string path = std::string(directory) + name;
+
+		FILE *file = nullptr;
+		Assert::AreEqual(0, (int)fopen_s(&file, path.c_str(), "wb"));
+		unsigned int key_length = (unsigned int)key.length(), elapsed = 0, headers_length = (unsigned int)headers.length();
+		unsigned long long body_length = body.length();
+		fputs("winhttp-replay 1\n", file);
+		fwrite(&key_length, sizeof(key_length), 1, file);
+		fwrite(&status, sizeof(status), 1, file);
+		fwrite(&elapsed, sizeof(elapsed), 1, file);
+		fwrite(&headers_length, sizeof(headers_length), 1, file);
+		fwrite(&body_length, sizeof(body_length), 1, file);
+		fwrite(key.data(), 1, key.length(), file);
+		fwrite(headers.data(), 1, headers.length(), file);
+		fwrite(body.data(), 1, body.length(), file);
+		fclose(file);
+		return path;
+	}
+
+	// Plays one canned body back through connection_t, as if the server had sent it
+	http::stl::response_t Playback(const char *name, const std::string &body, const std::string &headers = "HTTP/1.1 200 OK\r\n\r\n",
+		http::stl::digest_algorithm_t digest = http::stl::digest_none)
+	{
+		std::string path = WriteReplay(name, "GET http://replay.invalid:80/stream", 200, headers, body);
+		http::stl::replay_t replay(path, http::stl::replay_t::mode_replay);
+		http::stl::session_t sess("My User Agent");
+		http::stl::connection_t conn(sess, "http://replay.invalid");
+		conn.set_replay(&replay);
+		http::stl::request_t req("GET", "/stream");
+		req.set_digest(digest);
+		return conn.send(req);
+	}
+
+	std::string Hex(const std::string &raw)
+	{
+		static const char digits[] = "0123456789abcdef";
+		std::string hex;
+		for(size_t i = 0; i < raw.length(); ++i) {
+			hex.push_back(digits[(unsigned char)raw[i] >> 4]);
+			hex.push_back(digits[(unsigned char)raw[i] & 15]);
+		}
+		return hex;
+	}
+
+	std::string Digest(http::stl::digest_algorithm_t algorithm, const std::string &data)
+	{
+		http::stl::digest_t digest(algorithm);
+		digest.update(data.data(), data.length());
+		return Hex(digest.finish());
+	}
+
 	TEST_CLASS(StackInstantiation)
 	{
 	public:
@@ -50,6 +120,15 @@ namespace Tests
 			session_t sess("My User Agent");
 			connection_t conn(sess, "http://www.microsoft.com");
 		}
+
+		TEST_METHOD(SessionSocketOptions)
+		{
+			session_t sess("My User Agent");
+			Assert::IsTrue(sess.set_max_connections(4));
+			Assert::IsNull(sess.error());
+			Assert::IsFalse(sess.set_max_connections(0));
+			Assert::IsNotNull(sess.error());
+		}
 	};
 
 
@@ -89,6 +168,99 @@ namespace Tests
 			Check(resp);
 		}
 
+		TEST_METHOD(DeadlineExceeded)
+		{
+			request_t req("GET", "/");
+			req.set_deadline(1);
+
+			response_t resp = conn_.send(req);
+
+			Assert::AreEqual(-1, resp.status());
+			Assert::IsNotNull(conn_.error());
+		}
+
+		TEST_METHOD(ErrorClearedBySuccess)
+		{
+			request_t failing("GET", "/");
+			failing.set_deadline(1);
+			response_t resp = conn_.send(failing);
+			Assert::AreEqual(-1, resp.status());
+			Assert::IsFalse(conn_.ok());
+
+			request_t req("GET", "/");
+			resp = conn_.send(req);
+			Assert::AreEqual(200, resp.status());
+			Assert::IsTrue(conn_.ok());
+			Assert::IsNull(conn_.error());
+		}
+
+		TEST_METHOD(ReadSome)
+		{
+			request_t req("GET", "/");
+			response_t resp = conn_.send(req);
+			Assert::AreEqual(200, resp.status());
+
+			char buffer[64 * 1024];
+			size_t read = 0;
+			Assert::IsTrue(resp.read_some(buffer, sizeof(buffer), &read));
+			Assert::IsTrue(read > 0);
+			while(read > 0) {
+				Assert::IsTrue(resp.read_some(buffer, sizeof(buffer), &read));
+			}
+		}
+
+		TEST_METHOD(ResetAndReuse)
+		{
+			request_t req("GET", "/blah");
+			req.add_header("Accept-Language: en-US");
+			request_t moved(std::move(req));
+			moved.reset("GET", "/");
+
+			response_t resp = conn_.send(moved);
+			Assert::AreEqual(200, resp.status());
+			resp = conn_.send(moved);
+			Assert::AreEqual(200, resp.status());
+			Check(resp);
+
+			// reset() keeps the capacity, so refilling a request to the same size allocates nothing
+			counting_resource_t resource;
+			std::string long_url = "/" + std::string(256, 'a');
+			std::string body(4096, 'b');
+			http::stl::request_t sized("POST", long_url, &resource);
+			sized.set_body(body);
+			size_t allocations = resource.allocations;
+			sized.reset("POST", long_url);
+			sized.set_body(body);
+			Assert::AreEqual(allocations, resource.allocations);
+
+			// The stl session hands recycled requests and read buffers back out
+			http::stl::session_t sess("My User Agent");
+			http::stl::connection_t conn(sess, "http://www.microsoft.com");
+			http::stl::request_t pooled = sess.acquire_request("GET", "/blah");
+			pooled.add_header("Accept-Language: en-US");
+			sess.recycle(std::move(pooled));
+			Assert::AreEqual((size_t)1, sess.pooled_requests());
+
+			http::stl::request_t reused = sess.acquire_request("GET", "/");
+			Assert::AreEqual((size_t)0, sess.pooled_requests());
+			std::string language;
+			Assert::IsFalse(reused.header("Accept-Language", language));
+
+			stringstream ss;
+			http::stl::response_t stl_resp = conn.send(reused);
+			Assert::AreEqual(200, stl_resp.status());
+			Assert::IsTrue(stl_resp.read(ss));
+			sess.recycle(std::move(stl_resp));
+			Assert::AreEqual((size_t)1, sess.pooled_buffers());
+
+			stl_resp = conn.send(reused);
+			Assert::AreEqual(200, stl_resp.status());
+			Assert::IsTrue(stl_resp.read(ss));
+			Assert::AreEqual((size_t)0, sess.pooled_buffers());
+			sess.recycle(std::move(stl_resp));
+			Assert::AreEqual((size_t)1, sess.pooled_buffers());
+		}
+
 		session_t sess_;
 		connection_t conn_;
 	};
@@ -109,7 +281,190 @@ namespace Tests
 			Check(resp);
 		}
 
+		TEST_METHOD(GetHttp2)
+		{
+			request_t req("GET", "/");
+			req.set_option(option_enable_http2, true);
+			response_t resp = conn_.send(req);
+
+			// Older systems ignore the option and still answer over HTTP/1.1
+			Assert::AreEqual(200, resp.status());
+			Assert::IsTrue(conn_.ok());
+
+			// WinHTTP only speaks HTTP/2 from Windows 10 1607, where it can also tell which protocol was used
+			DWORD used = 0;
+			DWORD size = sizeof(used);
+			if(WinHttpQueryOption(resp.handle(), WINHTTP_OPTION_HTTP_PROTOCOL_USED, &used, &size)) {
+				Assert::IsTrue(resp.http2());
+			}
+			Check(resp);
+		}
+
 		session_t sess_;
 		connection_t conn_;
 	};
+
+	TEST_CLASS(Replay)
+	{
+	public:
+		TEST_METHOD(PlaybackWithoutNetwork)
+		{
+			std::string path = WriteReplay("winhttp-replay-playback.log", "GET http://replay.invalid:80/hello", 200,
+				"HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n", "hello, world");
+			http::stl::replay_t replay(path, http::stl::replay_t::mode_replay);
+			Assert::IsTrue(replay.ok());
+			Assert::AreEqual((size_t)1, replay.size());
+
+			http::stl::session_t sess("My User Agent");
+			http::stl::connection_t conn(sess, "http://replay.invalid");
+			conn.set_replay(&replay);
+
+			// The log loops, so the one recording answers both sends
+			for(int i = 0; i < 2; ++i) {
+				http::stl::request_t req("GET", "/hello");
+				http::stl::response_t resp = conn.send(req);
+				Assert::AreEqual(200, resp.status());
+
+				std::string content_type;
+				Assert::IsTrue(resp.header("Content-Type", content_type));
+				Assert::AreEqual(std::string("text/plain"), content_type);
+
+				stringstream ss;
+				Assert::IsTrue(resp.read(ss));
+				Assert::AreEqual(std::string("hello, world"), ss.str());
+			}
+
+			// Anything that was not recorded fails rather than going out to the network
+			Assert::ExpectException<std::runtime_error>([&conn]() {
+				http::stl::request_t missing("GET", "/missing");
+				conn.send(missing);
+			});
+		}
+	};
+
+	TEST_CLASS(StreamReader)
+	{
+	public:
+		TEST_METHOD(Lines)
+		{
+			http::stl::response_t resp = Playback("winhttp-stream-lines.log", "{\"a\":1}\n\n{\"b\":2}\r\n{\"c\":3}");
+			// A small buffer makes records straddle reads and forces it to grow
+			http::stl::stream_reader_t reader(resp, 4);
+
+			std::string line;
+			Assert::IsTrue(reader.next_line(line));
+			Assert::AreEqual(std::string("{\"a\":1}"), line);
+			Assert::IsTrue(reader.next_line(line));
+			Assert::AreEqual(std::string("{\"b\":2}"), line);
+			Assert::IsTrue(reader.next_line(line));
+			Assert::AreEqual(std::string("{\"c\":3}"), line);
+			Assert::IsFalse(reader.next_line(line));
+		}
+
+		TEST_METHOD(CrLfSplitAcrossReads)
+		{
+			// The first read ends on the CR, the LF starts the second; taking them as two line ends would dispatch early
+			http::stl::response_t resp = Playback("winhttp-stream-crlf.log", "data: a\r\ndata: b\r\n\r\n");
+			http::stl::stream_reader_t reader(resp, 8);
+
+			http::stl::stream_reader_t::event_t event;
+			Assert::IsTrue(reader.next_event(event));
+			Assert::AreEqual(std::string("a\nb"), event.data);
+			Assert::IsFalse(reader.next_event(event));
+		}
+
+		TEST_METHOD(ByteOrderMark)
+		{
+			http::stl::response_t resp = Playback("winhttp-stream-bom.log", "\xEF\xBB\xBF" "data: x\n\n");
+			http::stl::stream_reader_t reader(resp);
+
+			http::stl::stream_reader_t::event_t event;
+			Assert::IsTrue(reader.next_event(event));
+			Assert::AreEqual(std::string("message"), event.type);
+			Assert::AreEqual(std::string("x"), event.data);
+		}
+
+		TEST_METHOD(EventFields)
+		{
+			http::stl::response_t resp = Playback("winhttp-stream-fields.log",
+				": comment\n"
+				"event: update\n"
+				"id: 7\n"
+				"retry: 1500\n"
+				"data:first\n"
+				"data:  second\n"
+				"\n"
+				"data\n"
+				"\n"
+				"retry: 10x\n"
+				"data: last\n"
+				"\n"
+				"data: never dispatched\n");
+			http::stl::stream_reader_t reader(resp);
+
+			http::stl::stream_reader_t::event_t event;
+			Assert::IsTrue(reader.next_event(event));
+			Assert::AreEqual(std::string("update"), event.type);
+			Assert::AreEqual(std::string("first\n second"), event.data);
+			Assert::AreEqual(std::string("7"), event.id);
+			Assert::AreEqual(1500u, event.retry);
+
+			// A field name alone is a field with an empty value
+			Assert::IsTrue(reader.next_event(event));
+			Assert::AreEqual(std::string("message"), event.type);
+			Assert::AreEqual(std::string(), event.data);
+			Assert::AreEqual(std::string("7"), event.id);
+
+			// A retry that is not all digits is ignored
+			Assert::IsTrue(reader.next_event(event));
+			Assert::AreEqual(std::string("last"), event.data);
+			Assert::AreEqual(0u, event.retry);
+
+			// An event the stream ends in the middle of is dropped
+			Assert::IsFalse(reader.next_event(event));
+			Assert::AreEqual(std::string("7"), reader.last_event_id());
+		}
+	};
+
+	TEST_CLASS(Digests)
+	{
+	public:
+		TEST_METHOD(Crc32c)
+		{
+			Assert::AreEqual(std::string("e3069283"), Digest(http::stl::digest_crc32c, "123456789"));
+		}
+
+		TEST_METHOD(XxHash64)
+		{
+			Assert::AreEqual(std::string("ef46db3751d8e999"), Digest(http::stl::digest_xxhash64, ""));
+			Assert::AreEqual(std::string("d24ec4f1a98c6e5b"), Digest(http::stl::digest_xxhash64, "a"));
+			Assert::AreEqual(std::string("44bc2cf5ad770999"), Digest(http::stl::digest_xxhash64, "abc"));
+
+			// Fed in pieces that straddle the 32 byte stripes, it must agree with one update
+			std::string data;
+			for(int i = 0; i < 1000; ++i) {
+				data.push_back((char)('a' + i % 26));
+			}
+			http::stl::digest_t pieces(http::stl::digest_xxhash64);
+			for(size_t i = 0; i < data.length(); i += 7) {
+				pieces.update(data.data() + i, data.length() - i < 7 ? data.length() - i : 7);
+			}
+			Assert::AreEqual(Digest(http::stl::digest_xxhash64, data), Hex(pieces.finish()));
+		}
+
+		TEST_METHOD(VerifyDigest)
+		{
+			http::stl::response_t resp = Playback("winhttp-digest-match.log", "123456789",
+				"HTTP/1.1 200 OK\r\nx-goog-hash: crc32c=4waSgw==\r\n\r\n", http::stl::digest_crc32c);
+			stringstream ss;
+			Assert::IsTrue(resp.read(ss));
+			Assert::AreEqual(std::string("e3069283"), resp.digest());
+			Assert::IsTrue(resp.verify_digest());
+
+			http::stl::response_t tampered = Playback("winhttp-digest-mismatch.log", "123456780",
+				"HTTP/1.1 200 OK\r\nx-goog-hash: crc32c=4waSgw==\r\n\r\n", http::stl::digest_crc32c);
+			Assert::IsTrue(tampered.read(ss));
+			Assert::IsFalse(tampered.verify_digest());
+		}
+	};
 }
\ No newline at end of file
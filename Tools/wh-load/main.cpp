@@ -0,0 +1,531 @@
+// wh-load: an HTTP load generator on the library's own session_t/connection_t, so upstreams are capacity tested
+// with the same pooling, timeouts and protocol settings as the clients that run in production.
+//
+// Closed loop (the default) keeps every worker busy with one request at a time. Open loop (-R) sends at a fixed
+// rate no matter how slowly responses come back and times each request from when it was due to go out, which is
+// what keeps a stalled server from hiding its own stall (coordinated omission). Closed loop runs report their
+// latencies corrected the same way after the fact, against the mean interval between requests.
+
+#include "../../http_stl.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <intrin.h>
+#endif
+
+using namespace http::stl;
+
+namespace
+{
+	double ticks_per_microsecond()
+	{
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		return frequency.QuadPart / 1000000.0;
+	}
+
+	static const double tick_rate = ticks_per_microsecond();
+
+	inline unsigned long long now_microseconds()
+	{
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		return (unsigned long long)(now.QuadPart / tick_rate);
+	}
+
+	inline unsigned int highest_bit(unsigned long long value)
+	{
+		unsigned long index = 0;
+#if defined(_M_X64)
+		_BitScanReverse64(&index, value);
+#elif defined(_M_IX86)
+		if((value >> 32) != 0) {
+			_BitScanReverse(&index, (unsigned long)(value >> 32));
+			index += 32;
+		} else {
+			_BitScanReverse(&index, (unsigned long)value);
+		}
+#else
+		while(value >>= 1) {
+			++index;
+		}
+#endif
+		return (unsigned int)index;
+	}
+
+
+	// Log-linear histogram in the HdrHistogram layout: exact below 2048us, and above that 1024 sub-buckets per
+	// power of two, so every recorded value keeps three significant digits up to about 19 hours.
+	class histogram_t
+	{
+	public:
+		histogram_t() : counts_(bucket_count, 0), total_(0), min_(~0ull), max_(0), sum_(0.0) {}
+
+		void record(unsigned long long value, unsigned long long count = 1)
+		{
+			value = value < max_value ? value : max_value;
+			counts_[index_of(value)] += count;
+			total_ += count;
+			min_ = value < min_ ? value : min_;
+			max_ = value > max_ ? value : max_;
+			sum_ += (double)value * count;
+		}
+
+		void merge(const histogram_t &other)
+		{
+			for(size_t i = 0; i < bucket_count; ++i) {
+				counts_[i] += other.counts_[i];
+			}
+			total_ += other.total_;
+			min_ = other.min_ < min_ ? other.min_ : min_;
+			max_ = other.max_ > max_ ? other.max_ : max_;
+			sum_ += other.sum_;
+		}
+
+		// Backfills the requests a stalled closed loop never got to send: a value v recorded while requests were
+		// expected every interval also stands for v - interval, v - 2 * interval and so on
+		histogram_t corrected(unsigned long long interval) const
+		{
+			histogram_t result;
+			for(size_t i = 0; i < bucket_count; ++i) {
+				if(counts_[i] == 0) {
+					continue;
+				}
+				unsigned long long value = value_of(i);
+				result.record(value, counts_[i]);
+				if(interval == 0) {
+					continue;
+				}
+				for(unsigned long long missed = value > interval ? value - interval : 0; missed >= interval; missed -= interval) {
+					result.record(missed, counts_[i]);
+				}
+			}
+			return result;
+		}
+
+		unsigned long long value_at(double percentile) const
+		{
+			if(total_ == 0) {
+				return 0;
+			}
+			unsigned long long wanted = (unsigned long long)ceil(percentile / 100.0 * total_);
+			wanted = wanted > 0 ? wanted : 1;
+			unsigned long long seen = 0;
+			for(size_t i = 0; i < bucket_count; ++i) {
+				seen += counts_[i];
+				if(seen >= wanted) {
+					unsigned long long value = highest_equivalent(i);
+					return value < max_ ? value : max_;
+				}
+			}
+			return max_;
+		}
+
+		unsigned long long count_at_or_below(unsigned long long value) const
+		{
+			unsigned long long seen = 0;
+			for(size_t i = 0; i <= index_of(value < max_value ? value : max_value); ++i) {
+				seen += counts_[i];
+			}
+			return seen;
+		}
+
+		inline unsigned long long total() const { return total_; }
+		inline unsigned long long lowest() const { return total_ > 0 ? min_ : 0; }
+		inline unsigned long long highest() const { return max_; }
+		inline double mean() const { return total_ > 0 ? sum_ / total_ : 0.0; }
+
+	private:
+		static const unsigned int sub_bucket_bits = 11;
+		static const unsigned long long sub_bucket_count = 1ull << sub_bucket_bits;
+		static const unsigned long long half_count = sub_bucket_count / 2;
+		static const unsigned long long max_value = (1ull << 36) - 1;
+		static const size_t bucket_count = (size_t)((36 - sub_bucket_bits + 2) * half_count);
+
+		static size_t index_of(unsigned long long value)
+		{
+			if(value < sub_bucket_count) {
+				return (size_t)value;
+			}
+			unsigned int shift = highest_bit(value) - sub_bucket_bits + 1;
+			return (size_t)(shift * half_count + (value >> shift));
+		}
+
+		static unsigned long long value_of(size_t index)
+		{
+			if(index < sub_bucket_count) {
+				return index;
+			}
+			unsigned int shift = (unsigned int)(index / half_count - 1);
+			return (index - shift * half_count) << shift;
+		}
+
+		static unsigned long long highest_equivalent(size_t index)
+		{
+			if(index < sub_bucket_count) {
+				return index;
+			}
+			unsigned int shift = (unsigned int)(index / half_count - 1);
+			return value_of(index) + (1ull << shift) - 1;
+		}
+
+	private:
+		std::vector<unsigned long long> counts_;
+		unsigned long long total_;
+		unsigned long long min_;
+		unsigned long long max_;
+		double sum_;
+	};
+
+
+	struct template_t
+	{
+		std::string method;
+		std::string target;
+		std::vector<std::string> headers;
+		std::string body;
+	};
+
+	struct options_t
+	{
+		options_t() : workers(10), connections(10), duration(10), rate(0.0), timeout(30), http2(false), spectrum(false) {}
+		std::string url;
+		unsigned int workers;
+		unsigned int connections;
+		unsigned int duration;
+		double rate;
+		unsigned int timeout;
+		bool http2;
+		bool spectrum;
+		std::vector<std::string> headers;
+		std::vector<template_t> templates;
+	};
+
+	struct worker_result_t
+	{
+		worker_result_t() : requests(0), errors(0), bytes(0) { memset(statuses, 0, sizeof(statuses)); }
+		histogram_t latency;
+		histogram_t service;
+		unsigned long long requests;
+		unsigned long long errors;
+		unsigned long long bytes;
+		unsigned long long statuses[6];
+	};
+
+
+	void usage()
+	{
+		fprintf(stderr,
+			"Usage: wh-load [options] <url>\n"
+			"  -t <n>     workers sending requests, one in flight each (default 10)\n"
+			"  -c <n>     most sockets the session opens to the server (default 10)\n"
+			"  -d <s>     duration in seconds (default 10)\n"
+			"  -R <n>     open loop at n requests/second in total; closed loop without it\n"
+			"  -H <line>  header added to every request, repeatable\n"
+			"  -s <file>  request templates, used round robin (see below)\n"
+			"  --timeout <s>  per-phase timeout in seconds (default 30)\n"
+			"  --http2    offer HTTP/2 over TLS\n"
+			"  -L         print the full latency percentile spectrum\n"
+			"\n"
+			"Template files hold blocks separated by blank lines. A block is a \"METHOD target\" line, then header\n"
+			"lines, and optionally a \"@path\" line naming a file to send as the body. Targets are paths on <url>.\n");
+	}
+
+	bool read_file(const std::string &path, std::string &contents)
+	{
+		std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+		if(!in) {
+			return false;
+		}
+		contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+		return true;
+	}
+
+	bool load_templates(const std::string &path, std::vector<template_t> &templates)
+	{
+		std::ifstream in(path.c_str());
+		if(!in) {
+			fprintf(stderr, "wh-load: cannot open %s\n", path.c_str());
+			return false;
+		}
+
+		std::string line;
+		template_t current;
+		bool open = false;
+		while(true) {
+			bool more = (bool)std::getline(in, line);
+			if(more && !line.empty() && line.back() == '\r') {
+				line.pop_back();
+			}
+			if(!more || line.empty()) {
+				if(open) {
+					templates.push_back(current);
+					current = template_t();
+					open = false;
+				}
+				if(!more) {
+					break;
+				}
+				continue;
+			}
+
+			if(!open) {
+				size_t space = line.find(' ');
+				if(space == std::string::npos) {
+					fprintf(stderr, "wh-load: expected \"METHOD target\" in %s, got \"%s\"\n", path.c_str(), line.c_str());
+					return false;
+				}
+				current.method = line.substr(0, space);
+				current.target = line.substr(space + 1);
+				open = true;
+			} else if(line[0] == '@') {
+				if(!read_file(line.substr(1), current.body)) {
+					fprintf(stderr, "wh-load: cannot read body file %s\n", line.c_str() + 1);
+					return false;
+				}
+			} else {
+				current.headers.push_back(line);
+			}
+		}
+
+		if(templates.empty()) {
+			fprintf(stderr, "wh-load: no requests in %s\n", path.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	bool parse_options(int argc, char *argv[], options_t &options)
+	{
+		for(int i = 1; i < argc; ++i) {
+			std::string arg = argv[i];
+			bool has_value = i + 1 < argc;
+			if(arg == "-t" && has_value) {
+				options.workers = (unsigned int)strtoul(argv[++i], nullptr, 10);
+			} else if(arg == "-c" && has_value) {
+				options.connections = (unsigned int)strtoul(argv[++i], nullptr, 10);
+			} else if(arg == "-d" && has_value) {
+				options.duration = (unsigned int)strtoul(argv[++i], nullptr, 10);
+			} else if(arg == "-R" && has_value) {
+				options.rate = strtod(argv[++i], nullptr);
+			} else if(arg == "-H" && has_value) {
+				options.headers.push_back(argv[++i]);
+			} else if(arg == "-s" && has_value) {
+				if(!load_templates(argv[++i], options.templates)) {
+					return false;
+				}
+			} else if(arg == "--timeout" && has_value) {
+				options.timeout = (unsigned int)strtoul(argv[++i], nullptr, 10);
+			} else if(arg == "--http2") {
+				options.http2 = true;
+			} else if(arg == "-L") {
+				options.spectrum = true;
+			} else if(arg[0] != '-' && options.url.empty()) {
+				options.url = arg;
+			} else {
+				return false;
+			}
+		}
+
+		if(options.url.empty() || options.workers == 0 || options.connections == 0 || options.duration == 0 || options.rate < 0.0) {
+			return false;
+		}
+		if(options.templates.empty()) {
+			template_t get;
+			get.method = "GET";
+			get.target = options.url;
+			options.templates.push_back(get);
+		}
+		return true;
+	}
+
+
+	void run_worker(const options_t &options, connection_t &conn, unsigned int index, unsigned long long start,
+		unsigned long long end, worker_result_t &result)
+	{
+		std::vector<request_t> requests;
+		for(size_t i = 0; i < options.templates.size(); ++i) {
+			const template_t &t = options.templates[i];
+			request_t req(t.method, t.target);
+			for(size_t h = 0; h < options.headers.size(); ++h) {
+				req.add_header(options.headers[h]);
+			}
+			for(size_t h = 0; h < t.headers.size(); ++h) {
+				req.add_header(t.headers[h]);
+			}
+			if(!t.body.empty()) {
+				req.set_body(t.body);
+			}
+			requests.push_back(req);
+		}
+
+		// Open loop: each worker owns every workers-th slot of the schedule, staggered so they do not send together
+		double interval = options.rate > 0.0 ? 1000000.0 * options.workers / options.rate : 0.0;
+		unsigned long long sent = 0;
+		char buffer[64 * 1024];
+
+		for(size_t next = index % requests.size();; next = (next + 1) % requests.size(), ++sent) {
+			unsigned long long due = now_microseconds();
+			if(interval > 0.0) {
+				due = start + (unsigned long long)(interval * (sent + (double)index / options.workers));
+				unsigned long long now = now_microseconds();
+				if(due >= end) {
+					break;
+				}
+				if(due > now + 2000) {
+					Sleep((DWORD)((due - now) / 1000 - 1));
+				}
+				while(now_microseconds() < due) {
+					std::this_thread::yield();
+				}
+			} else if(due >= end) {
+				break;
+			}
+
+			unsigned long long began = now_microseconds();
+			try {
+				response_t resp = conn.send(requests[next]);
+				size_t bytes_read = 0;
+				while(resp.read(buffer, sizeof(buffer), &bytes_read) && bytes_read > 0) {
+					result.bytes += bytes_read;
+				}
+				int status = resp.status();
+				++result.statuses[status >= 100 && status < 600 ? status / 100 : 0];
+			}
+			catch(const std::exception &) {
+				++result.errors;
+			}
+
+			unsigned long long finished = now_microseconds();
+			// In open loop the wait behind a slow request counts, since a real client would have been waiting too
+			result.latency.record(finished - (interval > 0.0 ? due : began));
+			result.service.record(finished - began);
+			++result.requests;
+		}
+	}
+
+	void print_percentiles(const char *title, const histogram_t &histogram)
+	{
+		static const double percentiles[] = { 50.0, 75.0, 90.0, 99.0, 99.9, 99.99, 99.999, 100.0 };
+		printf("  %s (microseconds)\n", title);
+		printf("    min %llu  mean %.1f  max %llu\n", histogram.lowest(), histogram.mean(), histogram.highest());
+		for(size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); ++i) {
+			printf("    %8.3f%%  %llu\n", percentiles[i], histogram.value_at(percentiles[i]));
+		}
+	}
+
+	// The HdrHistogram .hgrm percentile distribution, five steps per halving of the distance to 100%
+	void print_spectrum(const histogram_t &histogram)
+	{
+		printf("\n       Value     Percentile TotalCount 1/(1-Percentile)\n\n");
+		for(unsigned int step = 0;; ++step) {
+			double percentile = 100.0 * (1.0 - pow(0.5, step / 5.0));
+			unsigned long long value = histogram.value_at(percentile);
+			unsigned long long count = histogram.count_at_or_below(value);
+			if(count >= histogram.total() || step > 200) {
+				printf("%12llu %14.12f %10llu\n", histogram.highest(), 1.0, histogram.total());
+				break;
+			}
+			printf("%12llu %14.12f %10llu %14.2f\n", value, percentile / 100.0, count, 1.0 / (1.0 - percentile / 100.0));
+		}
+		printf("#[Mean    = %12.3f, Max   = %12llu]\n", histogram.mean(), histogram.highest());
+		printf("#[Total count    = %12llu]\n", histogram.total());
+	}
+}
+
+
+int main(int argc, char *argv[])
+{
+	options_t options;
+	if(!parse_options(argc, argv, options)) {
+		usage();
+		return 2;
+	}
+
+	try {
+		session_t sess("wh-load");
+		sess.set_max_connections(options.connections);
+		// A connection per worker keeps error state apart; the sockets themselves are pooled by the session
+		std::vector<std::unique_ptr<connection_t> > connections;
+		for(unsigned int i = 0; i < options.workers; ++i) {
+			connections.push_back(std::unique_ptr<connection_t>(new connection_t(sess, options.url)));
+			connections.back()->set_timeout(options.timeout);
+			connections.back()->set_option(option_enable_http2, options.http2);
+		}
+
+		printf("Running %us test @ %s\n", options.duration, options.url.c_str());
+		printf("  %u workers, %u connections, ", options.workers, options.connections);
+		if(options.rate > 0.0) {
+			printf("open loop at %.1f requests/sec\n", options.rate);
+		} else {
+			printf("closed loop\n");
+		}
+
+		std::vector<std::unique_ptr<worker_result_t> > results;
+		std::vector<std::thread> workers;
+		unsigned long long start = now_microseconds() + 100000;
+		unsigned long long end = start + options.duration * 1000000ull;
+		for(unsigned int i = 0; i < options.workers; ++i) {
+			results.push_back(std::unique_ptr<worker_result_t>(new worker_result_t()));
+			worker_result_t &result = *results.back();
+			connection_t &conn = *connections[i];
+			workers.push_back(std::thread([&options, &conn, i, start, end, &result]() {
+				while(now_microseconds() < start) {
+					std::this_thread::yield();
+				}
+				run_worker(options, conn, i, start, end, result);
+			}));
+		}
+		for(size_t i = 0; i < workers.size(); ++i) {
+			workers[i].join();
+		}
+		double seconds = (now_microseconds() - start) / 1000000.0;
+
+		worker_result_t total;
+		histogram_t corrected;
+		for(size_t i = 0; i < results.size(); ++i) {
+			const worker_result_t &result = *results[i];
+			total.latency.merge(result.latency);
+			total.service.merge(result.service);
+			total.requests += result.requests;
+			total.errors += result.errors;
+			total.bytes += result.bytes;
+			for(int s = 0; s < 6; ++s) {
+				total.statuses[s] += result.statuses[s];
+			}
+			if(options.rate <= 0.0 && result.requests > 0) {
+				// One request at a time, so the mean latency is also the interval the worker meant to keep
+				corrected.merge(result.latency.corrected((unsigned long long)result.latency.mean()));
+			}
+		}
+		if(options.rate > 0.0) {
+			corrected = total.latency;
+		}
+
+		printf("  %llu requests in %.2fs, %.2fMB read, %llu errors\n", total.requests, seconds, total.bytes / 1048576.0, total.errors);
+		printf("  Requests/sec: %.2f\n", total.requests / seconds);
+		printf("  Transfer/sec: %.2fMB\n", total.bytes / 1048576.0 / seconds);
+		printf("  Status: 1xx %llu, 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu, other %llu\n", total.statuses[1], total.statuses[2],
+			total.statuses[3], total.statuses[4], total.statuses[5], total.statuses[0]);
+		print_percentiles("Latency, corrected for coordinated omission", corrected);
+		print_percentiles("Service time, as measured", total.service);
+		if(options.spectrum) {
+			print_spectrum(corrected);
+		}
+	}
+	catch(const std::exception &e) {
+		fprintf(stderr, "wh-load: %s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,483 @@
+#pragma once
+
+// The request pipeline shared by the stl and nostl flavors. Include it after the flavor's own header, it relies
+// on the WH_ macros and on a traits type the flavor provides:
+//
+//   typedef ... request_type;
+//   typedef ... error_type;
+//   static const wchar_t *method(const request_type &);
+//   static const wchar_t *url(const request_type &);
+//   static const char *body(const request_type &);
+//   static DWORD body_length(const request_type &);
+//   static unsigned int options(const request_type &);
+//   static unsigned long long deadline(const request_type &);
+//   template <class F> static bool each_header(const request_type &, F f);  // f(const wchar_t *line, DWORD length)
+//   static void fail(error_type &errors, const char *phase, DWORD code);   // may throw
+//
+// Everything here is inline and resolved at compile time, so each flavor only pays for what its traits use.
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#include <intrin.h>
+#define WH_HAS_SSE2 1
+#endif
+
+#ifndef WH_USE_WININET
+// Newer than the Windows 8.1 SDK the projects build with. The values are fixed by the API; systems without the
+// option fail WinHttpSetOption/WinHttpQueryOption at run time instead.
+#ifndef WINHTTP_OPTION_IPV6_FAST_FALLBACK
+#define WINHTTP_OPTION_IPV6_FAST_FALLBACK 140
+#endif
+#ifndef WINHTTP_OPTION_ENABLE_HTTP_PROTOCOL
+#define WINHTTP_OPTION_ENABLE_HTTP_PROTOCOL 133
+#endif
+#ifndef WINHTTP_OPTION_HTTP_PROTOCOL_USED
+#define WINHTTP_OPTION_HTTP_PROTOCOL_USED 134
+#endif
+#ifndef WINHTTP_PROTOCOL_FLAG_HTTP2
+#define WINHTTP_PROTOCOL_FLAG_HTTP2 0x1
+#endif
+#ifndef WINHTTP_OPTION_TCP_KEEPALIVE
+#define WINHTTP_OPTION_TCP_KEEPALIVE 152
+#endif
+#ifndef WINHTTP_OPTION_TCP_FAST_OPEN
+#define WINHTTP_OPTION_TCP_FAST_OPEN 153
+#endif
+#endif
+
+namespace http
+{
+	namespace core
+	{
+
+		// Bit positions match option_t in both flavors
+		enum option_bits_t
+		{
+			option_bit_allow_unknown_cert_authority = 1u << 0,
+			option_bit_allow_invalid_cert_name = 1u << 1,
+			option_bit_allow_invalid_cert_date = 1u << 2,
+			option_bit_enable_http2 = 1u << 3
+		};
+
+
+		// Seconds to milliseconds, worked out in 64 bits and capped where WinHttpSetTimeouts' int arguments end;
+		// a product that wrapped to 0 would read as no timeout at all
+		inline DWORD timeout_milliseconds(unsigned int timeout_seconds)
+		{
+			unsigned long long milliseconds = (unsigned long long)timeout_seconds * 1000;
+			return milliseconds < 0x7fffffffULL ? (DWORD)milliseconds : 0x7fffffffUL;
+		}
+
+		inline bool phase_timeout(unsigned int timeout_seconds, unsigned long long deadline, DWORD &milliseconds)
+		{
+			milliseconds = timeout_milliseconds(timeout_seconds);
+			if(deadline == 0) {
+				return true;
+			}
+
+			unsigned long long now = GetTickCount64();
+			if(now >= deadline) {
+				return false;
+			}
+			if(deadline - now < milliseconds) {
+				milliseconds = (DWORD)(deadline - now);
+			}
+			return true;
+		}
+
+		inline DWORD security_flags(unsigned int options)
+		{
+			DWORD flags = 0;
+			if((options & option_bit_allow_unknown_cert_authority) != 0) {
+				flags |= SECURITY_FLAG_IGNORE_UNKNOWN_CA;
+			}
+			if((options & option_bit_allow_invalid_cert_name) != 0) {
+				flags |= SECURITY_FLAG_IGNORE_CERT_CN_INVALID;
+			}
+			if((options & option_bit_allow_invalid_cert_date) != 0) {
+				flags |= SECURITY_FLAG_IGNORE_CERT_DATE_INVALID;
+			}
+			return flags;
+		}
+
+
+		// Session-wide socket tuning. WinHTTP applies these to every connection the session opens, so they are set
+		// once per socket rather than per request. On false GetLastError() has the reason, ERROR_INVALID_PARAMETER
+		// for values out of range, ERROR_NOT_SUPPORTED under WinINet, and whatever WinHTTP says on systems too old
+		// for the option.
+		inline bool set_tcp_fast_open(HINTERNET session, bool on)
+		{
+#ifndef WH_USE_WININET
+			BOOL value = on ? TRUE : FALSE;
+			return WinHttpSetOption(session, WINHTTP_OPTION_TCP_FAST_OPEN, &value, sizeof(value)) != FALSE;
+#else
+			(void)session;
+			(void)on;
+			SetLastError(ERROR_NOT_SUPPORTED);
+			return false;
+#endif
+		}
+
+		inline bool set_tcp_keepalive(HINTERNET session, bool on, unsigned int idle_ms, unsigned int interval_ms)
+		{
+			if(on && (idle_ms == 0 || interval_ms == 0)) {
+				SetLastError(ERROR_INVALID_PARAMETER);
+				return false;
+			}
+#ifndef WH_USE_WININET
+			// Same layout as struct tcp_keepalive, which lives in mstcpip.h behind winsock2.h
+			struct
+			{
+				ULONG onoff;
+				ULONG keepalivetime;
+				ULONG keepaliveinterval;
+			} value = { on ? 1u : 0u, idle_ms, interval_ms };
+			return WinHttpSetOption(session, WINHTTP_OPTION_TCP_KEEPALIVE, &value, sizeof(value)) != FALSE;
+#else
+			(void)session;
+			SetLastError(ERROR_NOT_SUPPORTED);
+			return false;
+#endif
+		}
+
+		// WinINet only has the process-wide limit, so there it applies to every session
+		inline bool set_max_connections(HINTERNET session, unsigned int per_server)
+		{
+			if(per_server == 0) {
+				SetLastError(ERROR_INVALID_PARAMETER);
+				return false;
+			}
+			DWORD value = per_server;
+#ifdef WH_USE_WININET
+			(void)session;
+			return InternetSetOptionW(nullptr, INTERNET_OPTION_MAX_CONNS_PER_SERVER, &value, sizeof(value)) != FALSE &&
+				InternetSetOptionW(nullptr, INTERNET_OPTION_MAX_CONNS_PER_1_0_SERVER, &value, sizeof(value)) != FALSE;
+#else
+			return WinHttpSetOption(session, WINHTTP_OPTION_MAX_CONNS_PER_SERVER, &value, sizeof(value)) != FALSE &&
+				WinHttpSetOption(session, WINHTTP_OPTION_MAX_CONNS_PER_1_0_SERVER, &value, sizeof(value)) != FALSE;
+#endif
+		}
+
+
+#ifndef WH_USE_WININET
+		// WinHttpReadDataEx (Windows 11 and Server 2022) can fill the whole buffer in one call where WinHttpReadData
+		// stops at whatever has arrived. It is looked up at run time so the library still loads on older systems.
+#ifndef WINHTTP_READ_DATA_EX_FLAG_FILL_BUFFER
+#define WINHTTP_READ_DATA_EX_FLAG_FILL_BUFFER 0x0000000000000001ull
+#endif
+		typedef DWORD (WINAPI *read_data_ex_t)(HINTERNET, LPVOID, DWORD, LPDWORD, ULONGLONG, DWORD, PVOID);
+
+		inline read_data_ex_t read_data_ex()
+		{
+			// Zero initialized, so there is no unsafe static construction; racing lookups store the same value
+			static void *volatile resolved = nullptr;
+			void *found = resolved;
+			if(found == nullptr) {
+				HMODULE module = GetModuleHandleW(L"winhttp.dll");
+				found = module != nullptr ? (void *)GetProcAddress(module, "WinHttpReadDataEx") : nullptr;
+				if(found == nullptr) {
+					found = (void *)1;
+				}
+				resolved = found;
+			}
+			return found != (void *)1 ? (read_data_ex_t)found : nullptr;
+		}
+#endif
+
+
+		// First CR or LF in [p, end), or end. Sixteen bytes per compare where SSE2 is available.
+		inline const char *find_line_end(const char *p, const char *end)
+		{
+#ifdef WH_HAS_SSE2
+			const __m128i lf = _mm_set1_epi8('\n');
+			const __m128i cr = _mm_set1_epi8('\r');
+			while(end - p >= 16) {
+				__m128i chunk = _mm_loadu_si128((const __m128i *)p);
+				int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, lf), _mm_cmpeq_epi8(chunk, cr)));
+				if(mask != 0) {
+					unsigned long index;
+					_BitScanForward(&index, (unsigned long)mask);
+					return p + index;
+				}
+				p += 16;
+			}
+#endif
+			for(; p < end; ++p) {
+				if(*p == '\n' || *p == '\r') {
+					return p;
+				}
+			}
+			return end;
+		}
+
+
+		template <class Traits>
+		class pipeline_t
+		{
+		public:
+			typedef typename Traits::request_type request_type;
+			typedef typename Traits::error_type error_type;
+
+			static const DWORD header_block_size = 4096;
+			static const DWORD inline_body_size = 64 * 1024;
+
+			// Opens a request handle on connect for req, relative urls are taken as they are and absolute ones
+			// must point at the same origin. Returns nullptr after reporting the failure.
+			static HINTERNET open(HINTERNET connect, const URL_COMPONENTSW &origin, const request_type &req, error_type &errors)
+			{
+				const wchar_t *path = Traits::url(req);
+
+				URL_COMPONENTSW url_comps;
+				memset(&url_comps, 0, sizeof(url_comps));
+				url_comps.dwStructSize = sizeof(url_comps);
+				url_comps.dwSchemeLength = -1;
+				url_comps.dwHostNameLength = -1;
+				url_comps.dwUrlPathLength = -1;
+				if(WH_INTERNETW(CrackUrl)(path, 0, 0, &url_comps)) {
+					// If we managed to parse it, then it's an absolute url
+					// Validate the scheme, domain, port
+					if(url_comps.dwSchemeLength > 0 && url_comps.nScheme != origin.nScheme) {
+						Traits::fail(errors, "request_t url used a different scheme than the connection_t was initialized with", 0);
+						return nullptr;
+					}
+
+					if(url_comps.dwHostNameLength > 0 && _wcsnicmp(url_comps.lpszHostName, origin.lpszHostName, url_comps.dwHostNameLength) != 0) {
+						Traits::fail(errors, "request_t url used a different host name than the connection_t was initialized with", 0);
+						return nullptr;
+					}
+
+					if(url_comps.nPort != origin.nPort) {
+						Traits::fail(errors, "request_t url used a different port than the connection_t was initialized with", 0);
+						return nullptr;
+					}
+
+					// Use only the path part for making the request_t, it points into the request's own url
+					path = url_comps.lpszUrlPath;
+				}
+
+				DWORD open_request_flags = 0;
+				if(origin.nScheme == INTERNET_SCHEME_HTTPS) {
+					open_request_flags |= WH_INTERNET_CONST(FLAG_SECURE);
+				}
+
+				const wchar_t *accept_types[] = { L"*/*", nullptr };
+				HINTERNET request = WH_HTTPW(OpenRequest)(connect, Traits::method(req), path, nullptr, nullptr, accept_types, open_request_flags WH_WININET_ARGS(0) );
+				if(request == nullptr) {
+					Traits::fail(errors, "WinHttpOpenRequest() failed", GetLastError());
+				}
+				return request;
+			}
+
+			// Applies certificate options, per-phase timeouts and the additional headers to an open request handle
+			static bool prepare(HINTERNET request, const request_type &req, unsigned int options, unsigned int timeout_seconds, error_type &errors)
+			{
+				options |= Traits::options(req);
+				DWORD flags = security_flags(options);
+				if(!WH_INTERNET(SetOption)(request, WH_INTERNET_CONST(OPTION_SECURITY_FLAGS), (LPVOID)&flags, sizeof(DWORD))) {
+					Traits::fail(errors, "WinHttpSetOption(WINHTTP_OPTION_SECURITY_FLAGS) on request_t handle failed", GetLastError());
+					return false;
+				}
+
+#ifndef WH_USE_WININET
+				// Offers h2 in ALPN; concurrent requests on the session then share one connection as streams.
+				// Systems before Windows 10 1607 reject the option and simply stay on HTTP/1.1.
+				if((options & option_bit_enable_http2) != 0) {
+					DWORD protocols = WINHTTP_PROTOCOL_FLAG_HTTP2;
+					WinHttpSetOption(request, WINHTTP_OPTION_ENABLE_HTTP_PROTOCOL, &protocols, sizeof(protocols));
+				}
+#endif
+
+				// Every phase gets the connection timeout, cut down to whatever is left before the request's deadline
+				DWORD timeout = 0;
+				if(!phase_timeout(timeout_seconds, Traits::deadline(req), timeout)) {
+					Traits::fail(errors, "request_t deadline exceeded before sending", 0);
+					return false;
+				}
+
+#ifdef WH_USE_WININET
+				if(!InternetSetOptionW(request, INTERNET_OPTION_CONNECT_TIMEOUT, (LPVOID)&timeout, sizeof(DWORD)) ||
+					!InternetSetOptionW(request, INTERNET_OPTION_SEND_TIMEOUT, (LPVOID)&timeout, sizeof(DWORD)) ||
+					!InternetSetOptionW(request, INTERNET_OPTION_RECEIVE_TIMEOUT, (LPVOID)&timeout, sizeof(DWORD))) {
+					Traits::fail(errors, "InternetSetOption() timeouts on request_t handle failed", GetLastError());
+					return false;
+				}
+#else
+				if(!WinHttpSetTimeouts(request, timeout, timeout, timeout, timeout)) {
+					Traits::fail(errors, "WinHttpSetTimeouts() on request_t handle failed", GetLastError());
+					return false;
+				}
+				if(!WinHttpSetOption(request, WINHTTP_OPTION_RECEIVE_RESPONSE_TIMEOUT, (LPVOID)&timeout, sizeof(DWORD))) {
+					Traits::fail(errors, "WinHttpSetOption(WINHTTP_OPTION_RECEIVE_RESPONSE_TIMEOUT) on request_t handle failed", GetLastError());
+					return false;
+				}
+#endif
+
+				// The additional headers go in as one CRLF separated block, one call instead of one per header
+				wchar_t block[header_block_size];
+				DWORD block_length = 0;
+				bool fits = true;
+				Traits::each_header(req, [&block, &block_length, &fits](const wchar_t *line, DWORD length) {
+					if(block_length + length + 2 > header_block_size) {
+						fits = false;
+						return false;
+					}
+					memcpy(block + block_length, line, length * sizeof(wchar_t));
+					block_length += length;
+					block[block_length++] = L'\r';
+					block[block_length++] = L'\n';
+					return true;
+				});
+
+				bool added = true;
+				if(fits) {
+					added = block_length == 0 || WH_HTTPW(AddRequestHeaders)(request, block, block_length, WH_HTTP_CONST(ADDREQ_FLAG_ADD) | WH_HTTP_CONST(ADDREQ_FLAG_REPLACE)) != FALSE;
+				} else {
+					// Too much to batch on the stack; fall back to adding them one at a time
+					added = Traits::each_header(req, [request](const wchar_t *line, DWORD length) {
+						return WH_HTTPW(AddRequestHeaders)(request, line, length, WH_HTTP_CONST(ADDREQ_FLAG_ADD) | WH_HTTP_CONST(ADDREQ_FLAG_REPLACE)) != FALSE;
+					});
+				}
+				if(!added) {
+					Traits::fail(errors, "WinHttpAddRequestHeaders() failed", GetLastError());
+					return false;
+				}
+				return true;
+			}
+
+			// Sends the request line, headers and body. Small bodies ride along as optional data so WinHTTP can put the
+			// whole request in a single write; large ones are written straight from the request, never copied.
+			static bool send(HINTERNET request, const request_type &req, error_type &errors)
+			{
+				DWORD total_request_length = Traits::body_length(req);
+
+#ifdef WH_USE_WININET
+				if(!HttpSendRequestW(request, nullptr, 0, (LPVOID)Traits::body(req), total_request_length)) {
+					Traits::fail(errors, "HttpSendRequest() failed", GetLastError());
+					return false;
+				}
+#else
+				bool inline_body = total_request_length <= inline_body_size;
+				LPVOID optional = inline_body && total_request_length > 0 ? (LPVOID)Traits::body(req) : WINHTTP_NO_REQUEST_DATA;
+				if(!WinHttpSendRequest(request, WINHTTP_NO_ADDITIONAL_HEADERS, 0, optional, inline_body ? total_request_length : 0, total_request_length, 0)) {
+					Traits::fail(errors, "WinHttpSendRequest() failed", GetLastError());
+					return false;
+				}
+
+				if(!inline_body) {
+					DWORD bytes_written = 0;
+					if(!WinHttpWriteData(request, Traits::body(req), total_request_length, &bytes_written)) {
+						Traits::fail(errors, "WinHttpWriteData() failed", GetLastError());
+						return false;
+					}
+					if(bytes_written != total_request_length) {
+						Traits::fail(errors, "WinHttpWriteData did not send entire request_t body", 0);
+						return false;
+					}
+				}
+#endif
+				return true;
+			}
+
+			// Waits until some of the body is available and reads at most count bytes of it, bytes_read is 0 at the end
+			static bool read_some(HINTERNET request, char *buffer, size_t count, size_t &bytes_read, error_type &errors)
+			{
+				bytes_read = 0;
+				DWORD data_available;
+				if(!WH_INTERNET(QueryDataAvailable)(request, &data_available WH_WININET_ARGS(0, 0) )) {
+					Traits::fail(errors, "WinHttpQueryDataAvailable() failed", GetLastError());
+					return false;
+				}
+				if(data_available == 0 || count == 0) {
+					return true;
+				}
+
+				DWORD copied = 0;
+				DWORD chunk_size = data_available < count ? data_available : (DWORD)count;
+#ifdef WH_USE_WININET
+				if(!InternetReadFile(request, buffer, chunk_size, &copied)) {
+					Traits::fail(errors, "InternetReadFile() failed", GetLastError());
+					return false;
+				}
+#else
+				if(!WinHttpReadData(request, buffer, chunk_size, &copied)) {
+					Traits::fail(errors, "WinHttpReadData() failed", GetLastError());
+					return false;
+				}
+#endif
+				bytes_read = copied;
+				return true;
+			}
+
+			// Reads up to count bytes in as few calls as the system allows and without asking what is available first,
+			// blocking until the buffer is full or the body ends; bytes_read is 0 at the end
+			static bool read_fill(HINTERNET request, char *buffer, size_t count, size_t &bytes_read, error_type &errors)
+			{
+				bytes_read = 0;
+				DWORD chunk_size = count < 0xffffffffu ? (DWORD)count : 0xffffffffu;
+				DWORD copied = 0;
+#ifdef WH_USE_WININET
+				// InternetReadFile already waits for the full amount
+				if(!InternetReadFile(request, buffer, chunk_size, &copied)) {
+					Traits::fail(errors, "InternetReadFile() failed", GetLastError());
+					return false;
+				}
+#else
+				read_data_ex_t read_ex = read_data_ex();
+				if(read_ex != nullptr) {
+					DWORD result = read_ex(request, buffer, chunk_size, &copied, WINHTTP_READ_DATA_EX_FLAG_FILL_BUFFER, 0, nullptr);
+					if(result != ERROR_SUCCESS) {
+						Traits::fail(errors, "WinHttpReadDataEx() failed", result);
+						return false;
+					}
+				}
+				else if(!WinHttpReadData(request, buffer, chunk_size, &copied)) {
+					Traits::fail(errors, "WinHttpReadData() failed", GetLastError());
+					return false;
+				}
+#endif
+				bytes_read = copied;
+				return true;
+			}
+
+			// Whether the response came over HTTP/2
+			static bool http2(HINTERNET request)
+			{
+#ifndef WH_USE_WININET
+				DWORD used = 0;
+				DWORD size = sizeof(used);
+				if(request != nullptr && WinHttpQueryOption(request, WINHTTP_OPTION_HTTP_PROTOCOL_USED, &used, &size)) {
+					return (used & WINHTTP_PROTOCOL_FLAG_HTTP2) != 0;
+				}
+#endif
+				return false;
+			}
+
+			// Reads the status code of a request whose response has been received
+			static bool status(HINTERNET request, int &status_code, error_type &errors)
+			{
+#ifdef WH_USE_WININET
+				char buffer[32];
+				DWORD size = sizeof(buffer) - 1;
+				DWORD header_index = 0;
+				if(!HttpQueryInfoA(request, HTTP_QUERY_STATUS_CODE, buffer, &size, &header_index)) {
+					Traits::fail(errors, "HttpQueryInfo() failed", GetLastError());
+					return false;
+				}
+				buffer[size] = 0;
+				status_code = atoi(buffer);
+#else
+				DWORD value = 0;
+				DWORD size = sizeof(value);
+				if(!WinHttpQueryHeaders(request, WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER, WINHTTP_HEADER_NAME_BY_INDEX, &value, &size, WINHTTP_NO_HEADER_INDEX)) {
+					Traits::fail(errors, "WinHttpQueryHeaders(WINHTTP_QUERY_STATUS_CODE) failed", GetLastError());
+					return false;
+				}
+				status_code = (int)value;
+#endif
+				return true;
+			}
+		};
+
+	} // namespace core
+
+} // namespace http
@@ -1,4 +1,5 @@
 #include "http_nostl.h"
+#include "http_core.h"
 #include <cstdlib>
 
 namespace http
@@ -43,33 +44,116 @@ namespace http
 
 
 
-		char *format_last_error(const char *msg)
+		// Binds the shared pipeline to the raw string/linked list requests and the non-throwing error handler
+		struct core_traits_t
 		{
-			LPSTR buffer = nullptr;
-			DWORD error_code = GetLastError();
-			if(!FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_FROM_HMODULE | FORMAT_MESSAGE_IGNORE_INSERTS,
+			typedef request_t request_type;
+			typedef error_handler_t error_type;
+
+			static inline const wchar_t *method(const request_t &req) { return req.method_; }
+			static inline const wchar_t *url(const request_t &req) { return req.url_; }
+			static inline const char *body(const request_t &req) { return req.body_; }
+			static inline DWORD body_length(const request_t &req) { return (DWORD)req.body_length_; }
+			static inline unsigned int options(const request_t &req) { return req.flags_; }
+			static inline unsigned long long deadline(const request_t &req) { return req.deadline_; }
+
+			template <class F>
+			static bool each_header(const request_t &req, F f)
+			{
+				for(const request_t::header_line *entry = req.headers_head_; entry != nullptr; entry = entry->next_) {
+					if(!f(entry->line_, (DWORD)lstrlenW(entry->line_))) {
+						return false;
+					}
+				}
+				return true;
+			}
+
+			static inline void fail(error_handler_t &errors, const char *phase, DWORD code) { errors.set_error(phase, code); }
+		};
+
+		typedef core::pipeline_t<core_traits_t> pipeline_t;
+
+
+		char *format_error(const char *phase, DWORD code)
+		{
+			if(code == 0) {
+				char *ret = new char[lstrlenA(phase) + 1];
+				lstrcpyA(ret, phase);
+				return ret;
+			}
+
+			// Format into the stack rather than FORMAT_MESSAGE_ALLOCATE_BUFFER, which needs a LocalFree
+			char buffer[512];
+			DWORD length = FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_FROM_HMODULE | FORMAT_MESSAGE_IGNORE_INSERTS,
 #ifdef WH_USE_WININET
 				GetModuleHandleA("wininet.dll"),
 #else
 				GetModuleHandleA("winhttp.dll"),
-#endif		
-				error_code, 0, (LPSTR)&buffer, 0, nullptr)) {
-
-				const char *tail = " (Failed to format error)";
-				char *ret = new char[lstrlenA(msg) + lstrlenA(tail) + 1];
-				lstrcpyA(ret, msg);
-				lstrcatA(ret, tail);
-				return ret;
+#endif
+				code, 0, buffer, sizeof(buffer), nullptr);
+			while(length > 0 && (buffer[length - 1] == '\r' || buffer[length - 1] == '\n')) {
+				--length;
 			}
+			buffer[length] = 0;
 
-			const char *sep = ": ";
-			char *ret = new char[lstrlenA(msg) + lstrlenA(sep) + lstrlenA(buffer) + 1];
-			lstrcpyA(ret, msg);
+			const char *sep = length > 0 ? ": " : " (Failed to format error)";
+			char *ret = new char[lstrlenA(phase) + lstrlenA(sep) + length + 1];
+			lstrcpyA(ret, phase);
 			lstrcatA(ret, sep);
 			lstrcatA(ret, buffer);
 			return ret;
 		}
 
+		char *format_last_error(const char *msg)
+		{
+			return format_error(msg, GetLastError());
+		}
+
+
+		error_handler_t::~error_handler_t()
+		{
+			delete[] message_;
+		}
+
+		const char *error_handler_t::error() const
+		{
+			if(phase_ == nullptr) {
+				return nullptr;
+			}
+			if(message_ == nullptr) {
+				message_ = format_error(phase_, code_);
+			}
+			return message_;
+		}
+
+		void error_handler_t::set_error(const char *phase, DWORD code)
+		{
+			delete[] message_;
+			message_ = nullptr;
+			ok_ = false;
+			phase_ = phase;
+			code_ = code;
+		}
+
+		void error_handler_t::clear_error()
+		{
+			delete[] message_;
+			message_ = nullptr;
+			ok_ = true;
+			phase_ = nullptr;
+			code_ = 0;
+		}
+
+		void error_handler_t::take_error(error_handler_t &other)
+		{
+			delete[] message_;
+			ok_ = other.ok_;
+			phase_ = other.phase_;
+			code_ = other.code_;
+			message_ = other.message_;
+			other.message_ = nullptr;
+		}
+
 
 		handle_manager_t::handle_manager_t() : handle_(nullptr) {}
 		handle_manager_t::handle_manager_t(HINTERNET h) : handle_(h) {}
@@ -83,15 +167,48 @@ namespace http
 			handle_ = WH_INTERNETW(Open)(wide_user_agent, 0, nullptr, nullptr, 0);
 			safe_array_delete(wide_user_agent);
 			if(handle_ == nullptr) {
-				set_error("WinHttpOpen() failed");
+				set_last_error("WinHttpOpen() failed");
 				return;
 			}
+
+#ifndef WH_USE_WININET
+			// Let WinHTTP race IPv6 against IPv4 (RFC 8305); older systems reject the option and stay sequential
+			DWORD fast_fallback = TRUE;
+			WinHttpSetOption(handle_, WINHTTP_OPTION_IPV6_FAST_FALLBACK, &fast_fallback, sizeof(fast_fallback));
+#endif
 		}
 
 		session_t::~session_t()
 		{
 		}
 
+		bool session_t::set_tcp_fast_open(bool on)
+		{
+			if(!core::set_tcp_fast_open(handle_, on)) {
+				set_last_error("WinHttpSetOption(WINHTTP_OPTION_TCP_FAST_OPEN) failed");
+				return false;
+			}
+			return true;
+		}
+
+		bool session_t::set_keepalive(bool on, unsigned int idle_ms, unsigned int interval_ms)
+		{
+			if(!core::set_tcp_keepalive(handle_, on, idle_ms, interval_ms)) {
+				set_last_error("WinHttpSetOption(WINHTTP_OPTION_TCP_KEEPALIVE) failed");
+				return false;
+			}
+			return true;
+		}
+
+		bool session_t::set_max_connections(unsigned int per_server)
+		{
+			if(!core::set_max_connections(handle_, per_server)) {
+				set_last_error("WinHttpSetOption(WINHTTP_OPTION_MAX_CONNS_PER_SERVER) failed");
+				return false;
+			}
+			return true;
+		}
+
 
 
 
@@ -107,7 +224,7 @@ namespace http
 			components_.dwHostNameLength = -1;
 
 			if(!WH_INTERNETW(CrackUrl)(host_, 0, 0, &components_)) {
-				set_error("WinHttpCrackUrl() failed");
+				set_last_error("WinHttpCrackUrl() failed");
 				return;
 			}
 
@@ -122,7 +239,7 @@ namespace http
 			safe_array_delete(host_only);
 
 			if(handle_ == nullptr) {
-				set_error("WinHttpConnect() failed");
+				set_last_error("WinHttpConnect() failed");
 				return;
 			}
 		}
@@ -144,109 +261,21 @@ namespace http
 
 		response_t connection_t::send(const request_t &req)
 		{
-			const wchar_t *path = req.url_;
-
-			URL_COMPONENTSW url_comps;
-			memset(&url_comps, 0, sizeof(url_comps));
-			url_comps.dwStructSize = sizeof(url_comps);
-			url_comps.dwSchemeLength = -1;
-			url_comps.dwHostNameLength = -1;
-			url_comps.dwUrlPathLength = -1;
-			if(WH_INTERNETW(CrackUrl)(req.url_, 0, 0, &url_comps)) {
-				// If we managed to parse it, then it's an absolute url
-				// Validate the scheme, domain, port
-				if(url_comps.dwSchemeLength > 0 && url_comps.nScheme != components_.nScheme) {
-					set_error("request_t url used a different scheme than the connection_t was initialized with");
-					return response_t(nullptr);
-				}
-
-				if(url_comps.dwHostNameLength > 0 && _wcsnicmp(url_comps.lpszHostName, components_.lpszHostName, url_comps.dwHostNameLength) != 0) {
-					set_error("request_t url used a different host name than the connection_t was initialized with");
-					return response_t(nullptr);
-				}
+			// A failure belongs to the call that hit it, not to every later one
+			clear_error();
 
-				if(url_comps.nPort != components_.nPort) {
-					set_error("request_t url used a different port than the connection_t was initialized with");
-					return response_t(nullptr);
-				}
-
-				// Use only the path part for making the request_t
-				path = url_comps.lpszUrlPath;
-			}
-
-			DWORD open_request_flags = 0;
-			if(components_.nScheme == INTERNET_SCHEME_HTTPS) {
-				open_request_flags |= WH_INTERNET_CONST(FLAG_SECURE);
-			}
-
-			const wchar_t *accept_types[] = {L"*/*", nullptr};
-			handle_manager_t request_t(WH_HTTPW(OpenRequest)(handle_, req.method_, path, nullptr, nullptr, accept_types, open_request_flags WH_WININET_ARGS(0) ));
+			handle_manager_t request_t(pipeline_t::open(handle_, components_, req, *this));
 			if(request_t == nullptr) {
-				set_error("WinHttpOpenRequest() failed");
-				return response_t(nullptr);
-			}
-
-			unsigned int option_flags = flags_ | req.flags_;
-			DWORD security_flags = 0;
-			if((option_flags & option_allow_unknown_cert_authority) != 0) {
-				security_flags |= SECURITY_FLAG_IGNORE_UNKNOWN_CA;
-			}
-			if((option_flags & option_allow_invalid_cert_name) != 0) {
-				security_flags |= SECURITY_FLAG_IGNORE_CERT_CN_INVALID;
-			}
-			if((option_flags & option_allow_invalid_cert_date) != 0) {
-				security_flags |= SECURITY_FLAG_IGNORE_CERT_DATE_INVALID;
-			}
-
-			if(!WH_INTERNET(SetOption)(request_t, WH_INTERNET_CONST(OPTION_SECURITY_FLAGS), (LPVOID)&security_flags, sizeof(DWORD))) {
-				set_error("WinHttpSetOption(WINHTTP_OPTION_SECURITY_FLAGS) on request_t handle failed");
 				return response_t(nullptr);
 			}
 
-			DWORD timeout = timeout_;
-			if(!WH_INTERNET(SetOption)(request_t, WH_INTERNET_CONST(OPTION_SEND_TIMEOUT), (LPVOID)&timeout, sizeof(DWORD))) {
-				set_error("WinHttpSetOption(WINHTTP_OPTION_SEND_TIMEOUT) on request_t handle failed");
+			if(!pipeline_t::prepare(request_t, req, flags_, timeout_, *this) || !pipeline_t::send(request_t, req, *this)) {
 				return response_t(nullptr);
 			}
 
-			const request_t::header_line *entry = req.headers_head_;
-			while(entry != nullptr) {
-				if(!WH_HTTPW(AddRequestHeaders)(request_t, entry->line_, lstrlenW(entry->line_), WH_HTTP_CONST(ADDREQ_FLAG_ADD) | WH_HTTP_CONST(ADDREQ_FLAG_REPLACE))) {
-					set_error("WinHttpAddRequestHeaders() failed");
-					return response_t(nullptr);
-				}
-				entry = entry->next_;
-			}
-
-			DWORD total_request_length = (DWORD)req.body_length_;
-
-#ifdef WH_USE_WININET
-			if(!HttpSendRequestW(request_t, nullptr, 0, req.body_, total_request_length)) {
-				set_error("HttpSendRequest() failed");
-				return response_t(nullptr);
-			}
-#else
-			if(!WinHttpSendRequest(request_t, nullptr, 0, nullptr, 0, total_request_length, 0)) {
-				set_error("WinHttpSendRequest() failed");
-				return response_t(nullptr);
-			}
-
-			if(total_request_length > 0) {
-				DWORD bytes_written = 0;
-				if(!WinHttpWriteData(request_t, req.body_, total_request_length, &bytes_written)) {
-					set_error("WinHttpWriteData() failed");
-					return response_t(nullptr);
-				}
-				if(bytes_written != req.body_length_) {
-					set_error("WinHttpWriteData did not send entire request_t body");
-					return response_t(nullptr);
-				}
-			}
-#endif
-
 			HINTERNET h = request_t.handle();
 			request_t.set_handle(nullptr);
-			return response_t(h);
+			return response_t(h, req.deadline_, core::timeout_milliseconds(timeout_));
 		}
 
 
@@ -263,8 +292,8 @@ namespace http
 
 		request_t::header_line::~header_line()
 		{
-			safe_delete(line_);
-			safe_delete(next_);
+			safe_array_delete(line_);
+			delete next_;
 		}
 
 
@@ -274,18 +303,87 @@ namespace http
 			url_(alloc_wide_string(url)),
 			body_(nullptr),
 			body_length_(0),
+			body_capacity_(0),
 			flags_(0),
+			deadline_(0),
 			headers_head_(nullptr),
 			headers_tail_(nullptr)
 		{
 		}
 
+		request_t::request_t(request_t &&other)
+			: method_(other.method_),
+			url_(other.url_),
+			body_(other.body_),
+			body_length_(other.body_length_),
+			body_capacity_(other.body_capacity_),
+			flags_(other.flags_),
+			deadline_(other.deadline_),
+			headers_head_(other.headers_head_),
+			headers_tail_(other.headers_tail_)
+		{
+			other.method_ = nullptr;
+			other.url_ = nullptr;
+			other.body_ = nullptr;
+			other.body_length_ = other.body_capacity_ = 0;
+			other.headers_head_ = other.headers_tail_ = nullptr;
+		}
+
 		request_t::~request_t()
 		{
 			safe_array_delete(method_);
 			safe_array_delete(url_);
 			safe_array_delete(body_);
-			safe_delete(headers_head_);
+			clear_headers();
+		}
+
+		request_t &request_t::operator=(request_t &&other)
+		{
+			if(this != &other) {
+				safe_array_delete(method_);
+				safe_array_delete(url_);
+				safe_array_delete(body_);
+				clear_headers();
+				method_ = other.method_;
+				url_ = other.url_;
+				body_ = other.body_;
+				body_length_ = other.body_length_;
+				body_capacity_ = other.body_capacity_;
+				flags_ = other.flags_;
+				deadline_ = other.deadline_;
+				headers_head_ = other.headers_head_;
+				headers_tail_ = other.headers_tail_;
+				other.method_ = nullptr;
+				other.url_ = nullptr;
+				other.body_ = nullptr;
+				other.body_length_ = other.body_capacity_ = 0;
+				other.headers_head_ = other.headers_tail_ = nullptr;
+			}
+			return *this;
+		}
+
+		void request_t::reset(const char *method, const char *url)
+		{
+			// The body buffer is kept, set_body() reuses it when the next body fits
+			safe_array_delete(method_);
+			safe_array_delete(url_);
+			method_ = alloc_wide_string(method);
+			url_ = alloc_wide_string(url);
+			body_length_ = 0;
+			clear_headers();
+			flags_ = 0;
+			deadline_ = 0;
+		}
+
+		void request_t::clear_headers()
+		{
+			while(headers_head_ != nullptr) {
+				header_line *next = headers_head_->next_;
+				headers_head_->next_ = nullptr;
+				delete headers_head_;
+				headers_head_ = next;
+			}
+			headers_tail_ = nullptr;
 		}
 
 		void request_t::add_header(const char *line)
@@ -302,12 +400,20 @@ namespace http
 
 		void request_t::set_body(const char *data, size_t length)
 		{
-			safe_array_delete(body_);
+			if(length > body_capacity_) {
+				safe_array_delete(body_);
+				body_ = new char[length];
+				body_capacity_ = length;
+			}
 			body_length_ = length;
-			body_ = new char[length];
 			memcpy(body_, data, length);
 		}
 
+		void request_t::set_timeout(unsigned int milliseconds)
+		{
+			deadline_ = GetTickCount64() + milliseconds;
+		}
+
 		void request_t::set_option(option_t opt, bool on)
 		{
 			if(on) {
@@ -320,49 +426,89 @@ namespace http
 
 
 
-		response_t::response_t(HINTERNET request_t)
+		response_t::response_t(HINTERNET request_t, unsigned long long deadline, DWORD timeout)
 			: handle_manager_t(request_t),
-			status_(-1)
+			status_(-1),
+			deadline_(deadline),
+			timeout_(timeout)
 		{
 			if(handle_ != nullptr) {
 #ifdef WH_USE_WININET
-				char status_code[32];
-				DWORD status_code_size = sizeof(status_code);
-				DWORD header_index = 0;
-				if(!HttpQueryInfo(request_t, HTTP_QUERY_STATUS_CODE, &status_code, &status_code_size, &header_index)) {
-					set_error("HttpQueryInfo() failed");
-					return;
-				}
-				status_code[status_code_size] = 0;
-				status_ = atoi(status_code);
+				pipeline_t::status(request_t, status_, *this);
 #else
 				if(!WinHttpReceiveResponse(request_t, nullptr)) {
-					set_error("WinHttpReceiveResponse() failed");
+					set_last_error("WinHttpReceiveResponse() failed");
 					return;
 				}
 				
-				DWORD status_code = 0;
-				DWORD status_code_size = sizeof(status_code);
-				if(!WinHttpQueryHeaders(request_t, WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER, WINHTTP_HEADER_NAME_BY_INDEX, &status_code, &status_code_size, WINHTTP_NO_HEADER_INDEX)) {
-					set_error("WinHttpWriteData did not send entire request_t body");
-					return;
-				}
-				status_ = (int)status_code;
+				pipeline_t::status(request_t, status_, *this);
 #endif
 			}
 		}
 
 		response_t::response_t(response_t &&other)
 			: handle_manager_t(other.handle_),
-			status_(other.status_)
+			status_(other.status_),
+			deadline_(other.deadline_),
+			timeout_(other.timeout_)
 		{
+			take_error(other);
 			other.handle_ = nullptr;
 		}
 
+		response_t &response_t::operator=(response_t &&other)
+		{
+			if(this != &other) {
+				if(handle_ != nullptr) WH_INTERNET(CloseHandle)(handle_);
+				handle_ = other.handle_;
+				take_error(other);
+				status_ = other.status_;
+				deadline_ = other.deadline_;
+				timeout_ = other.timeout_;
+				other.handle_ = nullptr;
+			}
+			return *this;
+		}
+
+		void response_t::reset()
+		{
+			if(handle_ != nullptr) {
+				WH_INTERNET(CloseHandle)(handle_);
+				handle_ = nullptr;
+			}
+			delete[] message_;
+			message_ = nullptr;
+			ok_ = true;
+			phase_ = nullptr;
+			code_ = 0;
+			status_ = -1;
+			deadline_ = 0;
+			timeout_ = 0;
+		}
+
 		response_t::~response_t()
 		{
 		}
 
+		bool response_t::arm_receive_timeout()
+		{
+			if(deadline_ == 0) {
+				return true;
+			}
+
+			unsigned long long now = GetTickCount64();
+			if(now >= deadline_) {
+				return false;
+			}
+			DWORD timeout = deadline_ - now < timeout_ ? (DWORD)(deadline_ - now) : timeout_;
+			return WH_INTERNET(SetOption)(handle_, WH_INTERNET_CONST(OPTION_RECEIVE_TIMEOUT), (LPVOID)&timeout, sizeof(DWORD)) != FALSE;
+		}
+
+		bool response_t::http2() const
+		{
+			return pipeline_t::http2(handle_);
+		}
+
 		bool response_t::read(char *buffer, size_t count, size_t *bytes_read)
 		{
 			if(handle_ == nullptr) {
@@ -374,36 +520,21 @@ namespace http
 
 			while(remaining > 0) {
 
-				DWORD data_available;
-				if(!WH_INTERNET(QueryDataAvailable)(handle_, &data_available WH_WININET_ARGS(0, 0) )) {
-					set_error("WinHttpQueryDataAvailable() failed");
+				if(!arm_receive_timeout()) {
+					set_error("request_t deadline exceeded while reading the response");
 					return false;
 				}
 
-				if(data_available == 0) {
+				size_t copied = 0;
+				if(!pipeline_t::read_fill(handle_, p, remaining, copied, *this)) {
+					return false;
+				}
+				if(copied == 0) {
 					break;
 				}
 
-				while(data_available > 0 && remaining > 0) {
-					DWORD copied;
-					DWORD chunk_size = data_available < remaining ? data_available : remaining;
-
-#ifdef WH_USE_WININET
-					if(!InternetReadFile(handle_, p, chunk_size, &copied)) {
-						set_error("InternetReadFile() failed");
-						return false;
-					}
-#else
-					if(!WinHttpReadData(handle_, p, chunk_size, &copied)) {
-						set_error("WinHttpReadData() failed");
-						return false;
-					}
-#endif
-
-					p += copied;
-					data_available -= copied;
-					remaining -= copied;
-				}
+				p += copied;
+				remaining -= copied;
 			}
 
 			if(bytes_read != nullptr) {
@@ -413,6 +544,27 @@ namespace http
 			return true;
 		}
 
+		bool response_t::read_some(char *buffer, size_t count, size_t *bytes_read)
+		{
+			if(handle_ == nullptr) {
+				return false;
+			}
+
+			if(!arm_receive_timeout()) {
+				set_error("request_t deadline exceeded while reading the response");
+				return false;
+			}
+
+			size_t copied = 0;
+			if(!pipeline_t::read_some(handle_, buffer, count, copied, *this)) {
+				return false;
+			}
+			if(bytes_read != nullptr) {
+				*bytes_read = copied;
+			}
+			return true;
+		}
+
 
 	} // namespace nostl
 
@@ -32,10 +32,13 @@ namespace http
 
 		class request_t;
 		class response_t;
+		struct core_traits_t;
 
 		void safe_free(void *s);
 		void safe_delete(void *s);
 
+		// The caller owns the returned message and releases it with delete[]
+		char *format_error(const char *phase, DWORD code);
 		char *format_last_error(const char *msg);
 
 
@@ -43,7 +46,8 @@ namespace http
 		{
 			option_allow_unknown_cert_authority = 0,
 			option_allow_invalid_cert_name,
-			option_allow_invalid_cert_date
+			option_allow_invalid_cert_date,
+			option_enable_http2
 		};
 
 
@@ -66,15 +70,25 @@ namespace http
 		class error_handler_t
 		{
 		public:
-			error_handler_t() : ok_(true), error_(nullptr) {}
-			virtual ~error_handler_t() { safe_free(error_); }
+			error_handler_t() : ok_(true), phase_(nullptr), code_(0), message_(nullptr) {}
+			virtual ~error_handler_t();
 			inline bool ok() const { return ok_; }
-			inline const char *error() const { return error_; }
-			inline void set_error(const char *msg) { safe_free(error_); error_ = _strdup(msg); }
+			inline const char *phase() const { return phase_; }
+			inline DWORD code() const { return code_; }
+			const char *error() const;
+			// phase must outlive the handler (a string literal); the message is only built if somebody asks for it
+			void set_error(const char *phase, DWORD code = 0);
+			inline void set_last_error(const char *phase) { set_error(phase, GetLastError()); }
+
+		protected:
+			void clear_error();
+			void take_error(error_handler_t &other);
 
 		protected:
 			bool ok_;
-			char *error_;
+			const char *phase_;
+			DWORD code_;
+			mutable char *message_;
 		};
 
 
@@ -83,6 +97,10 @@ namespace http
 		public:
 			session_t(const char *user_agent);
 			~session_t();
+			// Socket tuning, taken up by every connection the session opens
+			bool set_tcp_fast_open(bool on);
+			bool set_keepalive(bool on, unsigned int idle_ms = 30000, unsigned int interval_ms = 1000);
+			bool set_max_connections(unsigned int per_server);
 		};
 
 
@@ -108,6 +126,7 @@ namespace http
 		class request_t
 		{
 			friend class connection_t;
+			friend struct core_traits_t;
 
 		public:
 			struct header_line
@@ -119,19 +138,32 @@ namespace http
 			};
 
 			request_t(const char *method, const char *url);
+			request_t(const request_t &other) = delete;
+			request_t(request_t &&other);
 			virtual ~request_t();
+			inline const request_t &operator=(const request_t &other) = delete;
+			request_t &operator=(request_t &&other);
+			void reset(const char *method, const char *url);
 			void set_body(const char *data, size_t length);
 			void add_header(const char *line);
 			void set_option(option_t opt, bool on);
+			inline unsigned long long deadline() const { return deadline_; }
+			inline void set_deadline(unsigned long long tick) { deadline_ = tick; }
+			void set_timeout(unsigned int milliseconds);
 			
+		private:
+			void clear_headers();
+
 		private:
 			wchar_t *method_;
 			wchar_t *url_;
 			char *body_;
 			size_t body_length_;
+			size_t body_capacity_;
 			header_line *headers_head_;
 			header_line *headers_tail_;
 			unsigned int flags_;
+			unsigned long long deadline_;
 		};
 
 
@@ -140,21 +172,28 @@ namespace http
 			friend class connection_t;
 
 		private:
-			response_t(HINTERNET request_t);
+			response_t(HINTERNET request_t, unsigned long long deadline = 0, DWORD timeout = 0);
+			bool arm_receive_timeout();
 
 		public:
 			response_t(const response_t &other) = delete;
 			response_t(response_t &&other);
 			virtual ~response_t();
 			inline const response_t &operator=(const response_t &other) = delete;
-			inline const response_t &operator=(const response_t &&other) = delete;
+			response_t &operator=(response_t &&other);
+			void reset();
 			inline int status() const { return status_; }
 			inline bool succeeded() const { return status_ >= 200 && status_ < 300; }
 			inline bool failed() const { return !succeeded(); }
+			bool http2() const;
 			bool read(char *buffer, size_t count, size_t *bytes_read);
+			// Returns as soon as any bytes arrive rather than when buffer is full; 0 bytes means the body has ended
+			bool read_some(char *buffer, size_t count, size_t *bytes_read);
 
 		private:
 			int status_;
+			unsigned long long deadline_;
+			DWORD timeout_;
 		};
 
 	} // namespace nostl
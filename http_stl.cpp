@@ -1,323 +1,3758 @@
 #include "http_stl.h"
+#include "http_core.h"
+#include <WinDNS.h>
+#include <bcrypt.h>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#include <nmmintrin.h>
+#define WH_HAS_CRC32_INSTRUCTION 1
+#endif
+
+#pragma comment(lib, "dnsapi.lib")
+#pragma comment(lib, "bcrypt.lib")
 
 namespace http
 {
 	namespace stl
 	{
 
-		std::string format_last_error(const std::string &msg)
+		std::string format_error(const char *phase, DWORD code)
 		{
-			LPSTR buffer = nullptr;
-			DWORD error_code = GetLastError();
-			if(!FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_FROM_HMODULE | FORMAT_MESSAGE_IGNORE_INSERTS,
+			if(code == 0) {
+				return phase;
+			}
+
+			// Format into the stack rather than FORMAT_MESSAGE_ALLOCATE_BUFFER, which needs a LocalFree
+			char buffer[512];
+			DWORD length = FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_FROM_HMODULE | FORMAT_MESSAGE_IGNORE_INSERTS,
 #ifdef WH_USE_WININET
 				GetModuleHandleA("wininet.dll"),
 #else
 				GetModuleHandleA("winhttp.dll"),
-#endif				
-				error_code, 0, (LPSTR)&buffer, 0, nullptr)) {
-				return msg + " (Failed to format error)";
+#endif
+				code, 0, buffer, sizeof(buffer), nullptr);
+			if(length == 0) {
+				return std::string(phase) + " (Failed to format error)";
+			}
+			while(length > 0 && (buffer[length - 1] == '\r' || buffer[length - 1] == '\n')) {
+				--length;
 			}
-			return msg + ": " + buffer;
+			return std::string(phase) + ": " + std::string(buffer, length);
 		}
 
-
-		handle_manage_t::handle_manage_t() : handle_(nullptr) {}
-		handle_manage_t::handle_manage_t(HINTERNET h) : handle_(h) {}
-		handle_manage_t::~handle_manage_t() { if(handle_ != nullptr) WH_INTERNET(CloseHandle)(handle_); }
-
+		std::string format_last_error(const std::string &msg)
+		{
+			return format_error(msg.c_str(), GetLastError());
+		}
 
 
-		session_t::session_t(const std::string &user_agent)
+#if _HAS_EXCEPTIONS
+		const char *last_error_t::what() const throw()
 		{
-			std::wstring wide_user_agent = std::wstring(std::begin(user_agent), std::end(user_agent));
-			handle_ = WH_INTERNETW(Open)(wide_user_agent.c_str(), 0, nullptr, nullptr, 0);
-			if(handle_ == nullptr) {
-				THROW_LAST_ERROR("WinHttpOpen() failed");
-				return;
+			if(message_.empty()) {
+				message_ = format_error(std::runtime_error::what(), code_);
 			}
+			return message_.c_str();
 		}
+#endif
 
-		session_t::~session_t()
+
+		class heap_resource_t : public memory_resource_t
 		{
-		}
+		protected:
+			virtual void *do_allocate(size_t bytes, size_t) { return ::operator new(bytes); }
+			virtual void do_deallocate(void *p, size_t, size_t) { ::operator delete(p); }
+		};
 
+		// CRC32C (Castagnoli), reflected; SSE4.2 has an instruction for exactly this polynomial
+		struct crc32c_table_t
+		{
+			crc32c_table_t()
+			{
+				for(unsigned int i = 0; i < 256; ++i) {
+					unsigned int crc = i;
+					for(int bit = 0; bit < 8; ++bit) {
+						crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+					}
+					entries[i] = crc;
+				}
+#ifdef WH_HAS_CRC32_INSTRUCTION
+				int info[4];
+				__cpuid(info, 1);
+				hardware = (info[2] & (1 << 20)) != 0;
+#else
+				hardware = false;
+#endif
+			}
+			unsigned int entries[256];
+			bool hardware;
+		};
 
+		// Namespace scope rather than function local statics, those are not thread safe on this compiler
+		static heap_resource_t heap_resource;
+		static const crc32c_table_t crc32c_table;
 
+		memory_resource_t *default_resource()
+		{
+			return &heap_resource;
+		}
 
 
+		const std::string &error_handler_t::error() const
+		{
+			if(!formatted_) {
+				error_ = format_error(phase_, code_);
+				formatted_ = true;
+			}
+			return error_;
+		}
 
-		connection_t::connection_t(const session_t &sess, const std::string &host)
-			: flags_(0),
-			timeout_(30)
+		void error_handler_t::take_error(const error_handler_t &other)
 		{
-			host_ = std::wstring(std::begin(host), std::end(host));
+			ok_ = other.ok_;
+			phase_ = other.phase_;
+			code_ = other.code_;
+			formatted_ = other.formatted_;
+			error_ = other.error_;
+		}
 
-			memset(&components_, 0, sizeof(components_));
-			components_.dwStructSize = sizeof(components_);
-			components_.dwSchemeLength = -1;
-			components_.dwHostNameLength = -1;
 
-			if(!WH_INTERNETW(CrackUrl)(host_.c_str(), 0, 0, &components_)) {
-				THROW_LAST_ERROR("WinHttpCrackUrl() failed");
-				return;
-			}
+		static const unsigned long long download_min_segment_size = 1024 * 1024;
+		static const size_t download_chunk_size = 256 * 1024;
+		static const unsigned long long download_checkpoint_interval = 16 * 1024 * 1024;
 
-			std::wstring host_only(components_.lpszHostName, components_.dwHostNameLength);
-#ifdef WH_USE_WININET
-			handle_ = InternetConnectW(sess.handle(), host_only.c_str(), components_.nPort, nullptr, nullptr, INTERNET_SERVICE_HTTP, 0, 0);
-#else
-			handle_ = WinHttpConnect(sess.handle(), host_only.c_str(), components_.nPort, 0);
-#endif
-			if(handle_ == nullptr) {
-				THROW_LAST_ERROR("WinHttpConnect() failed");
-				return;
-			}
-		}
+		class scoped_file_t
+		{
+		public:
+			scoped_file_t(HANDLE h) : handle_(h) {}
+			scoped_file_t(const scoped_file_t &other) = delete;
+			~scoped_file_t() { close(); }
+			inline bool valid() const { return handle_ != INVALID_HANDLE_VALUE; }
+			inline void close() { if(handle_ != INVALID_HANDLE_VALUE) CloseHandle(handle_); handle_ = INVALID_HANDLE_VALUE; }
+			inline operator HANDLE() const { return handle_; }
 
-		connection_t::~connection_t()
+		private:
+			HANDLE handle_;
+		};
+
+		static bool write_file_at(HANDLE file, unsigned long long offset, const char *data, size_t length)
 		{
+			OVERLAPPED overlapped;
+			memset(&overlapped, 0, sizeof(overlapped));
+			overlapped.Offset = (DWORD)(offset & 0xffffffffu);
+			overlapped.OffsetHigh = (DWORD)(offset >> 32);
+			DWORD written = 0;
+			return WriteFile(file, data, (DWORD)length, &written, &overlapped) && written == length;
 		}
 
-		void connection_t::set_option(option_t opt, bool on)
+		struct download_range_t
 		{
-			if(on) {
-				flags_ |= (1u << opt);
-			} else {
-				flags_ &= ~(1u << opt);
-			}
-		}
+			download_range_t(unsigned long long f, unsigned long long l) : first(f), last(l) {}
+			unsigned long long first;
+			unsigned long long last;
+		};
 
-		response_t connection_t::send(const request_t &req)
+		static bool save_checkpoint(const download_state_t &state);
+
+		struct download_state_t
 		{
-			std::wstring path = req.url_;
+			download_state_t() : file(INVALID_HANDLE_VALUE), total(0), resumable(false), unsaved_bytes(0) {}
 
-			URL_COMPONENTSW url_comps;
-			memset(&url_comps, 0, sizeof(url_comps));
-			url_comps.dwStructSize = sizeof(url_comps);
-			url_comps.dwSchemeLength = -1;
-			url_comps.dwHostNameLength = -1;
-			url_comps.dwUrlPathLength = -1;
-			if(WH_INTERNETW(CrackUrl)(req.url_.c_str(), 0, 0, &url_comps)) {
-				// If we managed to parse it, then it's an absolute url
-				// Validate the scheme, domain, port
-				if(url_comps.dwSchemeLength > 0 && url_comps.nScheme != components_.nScheme) {
-					THROW_LAST_ERROR("request_t url used a different scheme than the connection_t was initialized with");
-					return response_t(nullptr);
+			void fail(const std::string &error)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if(failure.empty()) {
+					failure = error;
 				}
+			}
 
-				if(url_comps.dwHostNameLength > 0 && _wcsnicmp(url_comps.lpszHostName, components_.lpszHostName, url_comps.dwHostNameLength) != 0) {
-					THROW_LAST_ERROR("request_t url used a different host name than the connection_t was initialized with");
-					return response_t(nullptr);
+			void mark_completed(unsigned long long first, unsigned long long last, size_t bytes)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+
+				// Keep completed sorted and coalesced so the checkpoint stays a handful of ranges
+				auto iter = std::begin(completed);
+				while(iter != std::end(completed) && iter->last + 1 < first) {
+					++iter;
+				}
+				iter = completed.insert(iter, download_range_t(first, last));
+				auto next = iter + 1;
+				while(next != std::end(completed) && next->first <= iter->last + 1) {
+					if(next->last > iter->last) {
+						iter->last = next->last;
+					}
+					if(next->first < iter->first) {
+						iter->first = next->first;
+					}
+					next = completed.erase(next);
+					iter = next - 1;
 				}
 
-				if(url_comps.nPort != components_.nPort) {
-					THROW_LAST_ERROR("request_t url used a different port than the connection_t was initialized with");
-					return response_t(nullptr);
+				unsaved_bytes += bytes;
+				if(resumable && unsaved_bytes >= download_checkpoint_interval) {
+					// Data must be on disk before the checkpoint claims it
+					if(FlushFileBuffers(file)) {
+						save_checkpoint(*this);
+					}
+					unsaved_bytes = 0;
 				}
+			}
 
-				// Use only the path part for making the request_t
-				path = url_comps.lpszUrlPath;
+			std::mutex mutex;
+			HANDLE file;
+			std::string checkpoint_path;
+			std::string etag;
+			std::string last_modified;
+			std::string validator;
+			unsigned long long total;
+			bool resumable;
+			std::vector<download_range_t> pending;
+			std::vector<download_range_t> completed;
+			unsigned long long unsaved_bytes;
+			std::string failure;
+		};
+
+		static bool save_checkpoint(const download_state_t &state)
+		{
+			std::ostringstream ss;
+			ss << "winhttp-checkpoint 1\n";
+			ss << "total " << state.total << "\n";
+			ss << "etag " << state.etag << "\n";
+			ss << "last-modified " << state.last_modified << "\n";
+			for(auto iter = std::begin(state.completed); iter != std::end(state.completed); ++iter) {
+				ss << "range " << iter->first << " " << iter->last << "\n";
 			}
+			std::string contents = ss.str();
 
-			DWORD open_request_flags = 0;
-			if(components_.nScheme == INTERNET_SCHEME_HTTPS) {
-				open_request_flags |= WH_INTERNET_CONST(FLAG_SECURE);
+			// Write a sibling file and rename it over the old one, so a crash leaves either checkpoint intact
+			std::string temp_path = state.checkpoint_path + ".tmp";
+			{
+				scoped_file_t file(CreateFileA(temp_path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+				if(!file.valid()) {
+					return false;
+				}
+				if(!write_file_at(file, 0, contents.data(), contents.length()) || !FlushFileBuffers(file)) {
+					return false;
+				}
 			}
+			return MoveFileExA(temp_path.c_str(), state.checkpoint_path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != FALSE;
+		}
 
-			const wchar_t *accept_types[] = { L"*/*", nullptr };
-			handle_manage_t request_t(WH_HTTPW(OpenRequest)(handle_, req.method_.c_str(), path.c_str(), nullptr, nullptr, accept_types, open_request_flags WH_WININET_ARGS(0) ));
-			if(request_t == nullptr) {
-				THROW_LAST_ERROR("WinHttpOpenRequest() failed");
-				return response_t(nullptr);
+		static bool load_checkpoint(const std::string &path, download_state_t &state)
+		{
+			std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+			std::string line;
+			if(!std::getline(in, line) || line != "winhttp-checkpoint 1") {
+				return false;
 			}
 
-			unsigned int option_flags = flags_ | req.flags_;
-			DWORD security_flags = 0;
-			if((option_flags & option_allow_unknown_cert_authority) != 0) {
-				security_flags |= SECURITY_FLAG_IGNORE_UNKNOWN_CA;
+			while(std::getline(in, line)) {
+				size_t space = line.find(' ');
+				std::string key = line.substr(0, space);
+				std::string value = space == std::string::npos ? std::string() : line.substr(space + 1);
+				if(key == "total") {
+					state.total = strtoull(value.c_str(), nullptr, 10);
+				} else if(key == "etag") {
+					state.etag = value;
+				} else if(key == "last-modified") {
+					state.last_modified = value;
+				} else if(key == "range") {
+					char *end = nullptr;
+					unsigned long long first = strtoull(value.c_str(), &end, 10);
+					unsigned long long last = strtoull(end, nullptr, 10);
+					if(last < first || last >= state.total) {
+						return false;
+					}
+					state.completed.push_back(download_range_t(first, last));
+				}
 			}
-			if((option_flags & option_allow_invalid_cert_name) != 0) {
-				security_flags |= SECURITY_FLAG_IGNORE_CERT_CN_INVALID;
+			return true;
+		}
+
+		static bool parse_content_range_total(const std::string &value, unsigned long long &total)
+		{
+			// Content-Range: bytes <first>-<last>/<total>, or bytes */<total> on a 416
+			size_t slash = value.rfind('/');
+			if(slash == std::string::npos || slash + 1 >= value.length() || value[slash + 1] == '*') {
+				return false;
 			}
-			if((option_flags & option_allow_invalid_cert_date) != 0) {
-				security_flags |= SECURITY_FLAG_IGNORE_CERT_DATE_INVALID;
+			total = strtoull(value.c_str() + slash + 1, nullptr, 10);
+			return true;
+		}
+
+
+
+		static std::string trim(const std::string &s)
+		{
+			size_t first = s.find_first_not_of(" \t");
+			if(first == std::string::npos) {
+				return std::string();
 			}
+			size_t last = s.find_last_not_of(" \t\r\n");
+			return s.substr(first, last - first + 1);
+		}
 
-			if(!WH_INTERNET(SetOption)(request_t, WH_INTERNET_CONST(OPTION_SECURITY_FLAGS), (LPVOID)&security_flags, sizeof(DWORD))) {
-				THROW_LAST_ERROR("WinHttpSetOption(WINHTTP_OPTION_SECURITY_FLAGS) on request_t handle failed");
-				return response_t(nullptr);
+		static bool match_header_line(const std::string &line, const std::string &name, std::string &value)
+		{
+			if(line.length() <= name.length() || line[name.length()] != ':' || _strnicmp(line.c_str(), name.c_str(), name.length()) != 0) {
+				return false;
 			}
+			value = trim(line.substr(name.length() + 1));
+			return true;
+		}
 
-			DWORD timeout = timeout_;
-			if(!WH_INTERNET(SetOption)(request_t, WH_INTERNET_CONST(OPTION_SEND_TIMEOUT), (LPVOID)&timeout, sizeof(DWORD))) {
-				THROW_LAST_ERROR("WinHttpSetOption(WINHTTP_OPTION_SEND_TIMEOUT) on request_t handle failed");
-				return response_t(nullptr);
+		static bool find_header(const std::string &raw, const std::string &name, std::string &value)
+		{
+			// raw is a CRLF separated header block; the first line is the status line
+			bool found = false;
+			size_t start = raw.find("\r\n");
+			while(start != std::string::npos && start + 2 < raw.length()) {
+				start += 2;
+				size_t end = raw.find("\r\n", start);
+				std::string field;
+				if(match_header_line(raw.substr(start, end == std::string::npos ? std::string::npos : end - start), name, field)) {
+					value = found ? value + ", " + field : field;
+					found = true;
+				}
+				start = end;
 			}
+			return found;
+		}
 
-			auto headers_end = std::end(req.additional_headers_);
-			for(auto iter = std::begin(req.additional_headers_); iter != headers_end; ++iter) {
-				if(!WH_HTTPW(AddRequestHeaders)(request_t, iter->c_str(), iter->length(), WH_HTTP_CONST(ADDREQ_FLAG_ADD) | WH_HTTP_CONST(ADDREQ_FLAG_REPLACE))) {
-					THROW_LAST_ERROR("WinHttpAddRequestHeaders() failed");
-					return response_t(nullptr);
+		static bool cache_directive(const std::string &cache_control, const char *name, long long *argument)
+		{
+			size_t name_length = strlen(name);
+			size_t start = 0;
+			while(start < cache_control.length()) {
+				size_t end = cache_control.find(',', start);
+				std::string directive = trim(cache_control.substr(start, end == std::string::npos ? std::string::npos : end - start));
+				if(directive.length() >= name_length && _strnicmp(directive.c_str(), name, name_length) == 0 &&
+					(directive.length() == name_length || directive[name_length] == '=')) {
+					if(argument != nullptr) {
+						size_t digits = directive.find_first_of("0123456789", name_length);
+						*argument = digits == std::string::npos ? 0 : strtoll(directive.c_str() + digits, nullptr, 10);
+					}
+					return true;
+				}
+				if(end == std::string::npos) {
+					break;
 				}
+				start = end + 1;
 			}
+			return false;
+		}
 
-			DWORD total_request_length = (DWORD)req.body_.length();
+		static long long days_from_civil(long long y, unsigned int m, unsigned int d)
+		{
+			y -= m <= 2;
+			long long era = (y >= 0 ? y : y - 399) / 400;
+			unsigned int yoe = (unsigned int)(y - era * 400);
+			unsigned int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+			unsigned int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+			return era * 146097 + (long long)doe - 719468;
+		}
 
-#ifdef WH_USE_WININET
-			if(!HttpSendRequestW(request_t, nullptr, 0, (LPVOID)req.body_.c_str(), total_request_length)) {
-				THROW_LAST_ERROR("HttpSendRequest() failed");
-				return response_t(nullptr);
+		static bool parse_http_date(const std::string &value, long long &seconds)
+		{
+			// Accepts IMF-fixdate, RFC 850 and asctime forms by pulling out the month name and the numbers in order
+			static const char *months[] = { "jan", "feb", "mar", "apr", "may", "jun", "jul", "aug", "sep", "oct", "nov", "dec" };
+			long long numbers[6];
+			int number_count = 0;
+			int month = -1;
+			bool month_first = false;
+			size_t i = 0;
+			while(i < value.length()) {
+				if(isdigit((unsigned char)value[i])) {
+					if(number_count == 6) {
+						return false;
+					}
+					numbers[number_count++] = strtoll(value.c_str() + i, nullptr, 10);
+					while(i < value.length() && isdigit((unsigned char)value[i])) ++i;
+				} else if(isalpha((unsigned char)value[i])) {
+					size_t start = i;
+					while(i < value.length() && isalpha((unsigned char)value[i])) ++i;
+					for(int m = 0; month < 0 && i - start == 3 && m < 12; ++m) {
+						if(_strnicmp(value.c_str() + start, months[m], 3) == 0) {
+							month = m + 1;
+							month_first = number_count == 0;
+						}
+					}
+				} else {
+					++i;
+				}
 			}
-#else
-			if(!WinHttpSendRequest(request_t, WINHTTP_NO_ADDITIONAL_HEADERS, 0, WINHTTP_NO_REQUEST_DATA, 0, total_request_length, 0)) {
-				THROW_LAST_ERROR("WinHttpSendRequest() failed");
-				return response_t(nullptr);
+			if(month < 0 || number_count != 5) {
+				return false;
 			}
 
-			if(total_request_length > 0) {
-				DWORD bytes_written = 0;
-				if(!WinHttpWriteData(request_t, req.body_.data(), total_request_length, &bytes_written)) {
-					THROW_LAST_ERROR("WinHttpWriteData() failed");
-					return response_t(nullptr);
-				}
-				if(bytes_written != req.body_.length()) {
-					THROW_ERROR("WinHttpWriteData did not send entire request_t body");
-					return response_t(nullptr);
-				}
+			long long day, year, hour, minute, second;
+			if(month_first) {
+				day = numbers[0]; hour = numbers[1]; minute = numbers[2]; second = numbers[3]; year = numbers[4];
+			} else {
+				day = numbers[0]; year = numbers[1]; hour = numbers[2]; minute = numbers[3]; second = numbers[4];
 			}
-#endif
-
-			HINTERNET h = request_t.handle();
-			request_t.set_handle(nullptr);
-			return response_t(h);
+			if(year < 100) {
+				year += year < 70 ? 2000 : 1900;
+			}
+			seconds = days_from_civil(year, (unsigned int)month, (unsigned int)day) * 86400 + hour * 3600 + minute * 60 + second;
+			return true;
 		}
 
 
 
+		struct cache_t::entry_t
+		{
+			entry_t() : status(0), response_time(0), freshness_lifetime(0), initial_age(0), no_cache(false) {}
 
+			inline size_t size() const { return key.length() + vary.length() + headers.length() + (body ? body->length() : 0); }
+			inline long long current_age(long long now) const { return initial_age + (now > response_time ? now - response_time : 0); }
 
+			void update_freshness()
+			{
+				// RFC 9111 section 4.2: freshness lifetime and the age the response already had when we got it
+				std::string cache_control, value;
+				find_header(headers, "Cache-Control", cache_control);
+				no_cache = cache_directive(cache_control, "no-cache", nullptr);
+				if(cache_control.empty() && find_header(headers, "Pragma", value)) {
+					no_cache = cache_directive(value, "no-cache", nullptr);
+				}
 
+				long long date = response_time;
+				if(find_header(headers, "Date", value)) {
+					parse_http_date(value, date);
+				}
 
-		request_t::request_t(const std::string &method, const std::string &url)
-			: method_(std::begin(method), std::end(method)),
-			url_(std::begin(url), std::end(url)),
-			flags_(0)
-		{
-		}
+				long long age = 0;
+				if(find_header(headers, "Age", value)) {
+					age = strtoll(value.c_str(), nullptr, 10);
+				}
+				long long apparent_age = response_time > date ? response_time - date : 0;
+				initial_age = apparent_age > age ? apparent_age : age;
 
-		request_t::~request_t()
+				long long seconds = 0;
+				freshness_lifetime = 0;
+				if(cache_directive(cache_control, "max-age", &seconds)) {
+					freshness_lifetime = seconds;
+				} else if(find_header(headers, "Expires", value)) {
+					// An unparseable Expires means already expired
+					if(parse_http_date(value, seconds) && seconds > date) {
+						freshness_lifetime = seconds - date;
+					}
+				} else if(find_header(headers, "Last-Modified", value) && parse_http_date(value, seconds) && seconds < date) {
+					freshness_lifetime = (date - seconds) / 10;
+				}
+			}
+
+			std::string key;
+			std::string vary;
+			int status;
+			std::string headers;
+			std::shared_ptr<const std::string> body;
+			long long response_time;
+			long long freshness_lifetime;
+			long long initial_age;
+			bool no_cache;
+		};
+
+		struct cache_t::shard_t
 		{
-		}
+			shard_t() : bytes(0) {}
 
-		void request_t::add_header(const std::string &line)
+			std::mutex mutex;
+			std::list<std::shared_ptr<entry_t>> lru;
+			std::unordered_map<std::string, std::list<std::shared_ptr<entry_t>>::iterator> index;
+			size_t bytes;
+		};
+
+		static std::string vary_key(const std::string &headers, const request_t &req)
 		{
-			additional_headers_.push_back(std::wstring(std::begin(line), std::end(line)));
+			std::string vary, result;
+			if(!find_header(headers, "Vary", vary)) {
+				return result;
+			}
+
+			size_t start = 0;
+			while(start < vary.length()) {
+				size_t end = vary.find(',', start);
+				std::string name = trim(vary.substr(start, end == std::string::npos ? std::string::npos : end - start));
+				std::string value;
+				req.header(name, value);
+				result += name + ": " + value + "\n";
+				if(end == std::string::npos) {
+					break;
+				}
+				start = end + 1;
+			}
+			return result;
 		}
 
-		void request_t::set_option(option_t opt, bool on)
+		static std::string merge_headers(const std::string &stored, const std::string &updated)
 		{
-			if(on) {
-				flags_ |= (1u << opt);
+			// Header fields from a 304 replace the stored ones of the same name (RFC 9111 section 3.2)
+			std::vector<std::string> lines;
+			size_t start = 0;
+			while(start < stored.length()) {
+				size_t end = stored.find("\r\n", start);
+				std::string line = stored.substr(start, end == std::string::npos ? std::string::npos : end - start);
+				if(!line.empty()) {
+					lines.push_back(line);
+				}
+				start = end == std::string::npos ? stored.length() : end + 2;
 			}
-			else {
-				flags_ &= ~(1u << opt);
+
+			start = updated.find("\r\n");
+			while(start != std::string::npos && start + 2 < updated.length()) {
+				start += 2;
+				size_t end = updated.find("\r\n", start);
+				std::string line = updated.substr(start, end == std::string::npos ? std::string::npos : end - start);
+				size_t colon = line.find(':');
+				start = end;
+				if(colon == std::string::npos) {
+					continue;
+				}
+
+				std::string name = line.substr(0, colon);
+				std::string ignored;
+				if(match_header_line(line, "Content-Length", ignored) || match_header_line(line, "Transfer-Encoding", ignored)) {
+					continue;
+				}
+				for(auto iter = lines.empty() ? std::end(lines) : std::begin(lines) + 1; iter != std::end(lines);) {
+					iter = match_header_line(*iter, name, ignored) ? lines.erase(iter) : iter + 1;
+				}
+				lines.push_back(line);
+			}
+
+			std::string merged;
+			for(auto iter = std::begin(lines); iter != std::end(lines); ++iter) {
+				merged += *iter + "\r\n";
 			}
+			return merged + "\r\n";
 		}
 
 
 
+		static unsigned long long now_microseconds()
+		{
+			LARGE_INTEGER frequency, counter;
+			QueryPerformanceFrequency(&frequency);
+			QueryPerformanceCounter(&counter);
+			return (unsigned long long)(counter.QuadPart / frequency.QuadPart * 1000000 + counter.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+		}
 
-		response_t::response_t(HINTERNET request_t)
-			: handle_manage_t(request_t),
-			status_(-1),
-			buffer_(nullptr)
+		static unsigned int crc32c_update(unsigned int crc, const unsigned char *p, size_t length)
 		{
-			if(handle_ != nullptr) {
-#ifdef WH_USE_WININET
-				char status_code[32];
-				DWORD status_code_size = sizeof(status_code);
-				DWORD header_index = 0;
-				if(!HttpQueryInfoA(request_t, HTTP_QUERY_STATUS_CODE, &status_code, &status_code_size, &header_index)) {
-					THROW_LAST_ERROR("HttpQueryInfo() failed");
-					return;
+#ifdef WH_HAS_CRC32_INSTRUCTION
+			if(crc32c_table.hardware) {
+#ifdef _M_X64
+				unsigned long long wide = crc;
+				for(; length >= 8; p += 8, length -= 8) {
+					unsigned long long word;
+					memcpy(&word, p, sizeof(word));
+					wide = _mm_crc32_u64(wide, word);
 				}
-				status_code[status_code_size] = 0;
-				status_ = atoi(status_code);
+				crc = (unsigned int)wide;
 #else
-				if(!WinHttpReceiveResponse(request_t, nullptr)) {
-					THROW_LAST_ERROR("WinHttpReceiveResponse() failed");
-					return;
+				for(; length >= 4; p += 4, length -= 4) {
+					unsigned int word;
+					memcpy(&word, p, sizeof(word));
+					crc = _mm_crc32_u32(crc, word);
 				}
-
-				DWORD status_code = 0;
-				DWORD status_code_size = sizeof(status_code);
-				if(!WinHttpQueryHeaders(request_t, WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER, WINHTTP_HEADER_NAME_BY_INDEX, &status_code, &status_code_size, WINHTTP_NO_HEADER_INDEX)) {
-					THROW_ERROR("WinHttpWriteData did not send entire request_t body");
-					return;
+#endif
+				for(; length > 0; ++p, --length) {
+					crc = _mm_crc32_u8(crc, *p);
 				}
-				status_ = (int)status_code;
+				return crc;
+			}
 #endif
+			for(; length > 0; ++p, --length) {
+				crc = crc32c_table.entries[(crc ^ *p) & 0xff] ^ (crc >> 8);
 			}
+			return crc;
 		}
 
-		response_t::response_t(response_t &&other)
-			: handle_manage_t(other.handle_),
-			status_(other.status_),
-			buffer_(other.buffer_)
+		// XXH64 with seed 0
+		static const unsigned long long xxh_prime1 = 11400714785074694791ULL;
+		static const unsigned long long xxh_prime2 = 14029467366897019727ULL;
+		static const unsigned long long xxh_prime3 = 1609587929392839161ULL;
+		static const unsigned long long xxh_prime4 = 9650029242287828579ULL;
+		static const unsigned long long xxh_prime5 = 2870177450012600261ULL;
+
+		static inline unsigned long long xxh_rotl(unsigned long long x, int r)
 		{
-			other.handle_ = nullptr;
-			other.buffer_ = nullptr;
+			return (x << r) | (x >> (64 - r));
 		}
 
-		response_t::~response_t()
+		static inline unsigned long long xxh_round(unsigned long long acc, unsigned long long input)
 		{
-			if(buffer_ != nullptr) delete[] buffer_;
+			acc += input * xxh_prime2;
+			return xxh_rotl(acc, 31) * xxh_prime1;
 		}
 
-		bool response_t::read(std::ostream &out)
+		static inline unsigned long long xxh_merge(unsigned long long acc, unsigned long long lane)
 		{
-			if(handle_ == nullptr) {
-				return false;
+			acc ^= xxh_round(0, lane);
+			return acc * xxh_prime1 + xxh_prime4;
+		}
+
+		static inline unsigned long long read_u64(const unsigned char *p)
+		{
+			unsigned long long value;
+			memcpy(&value, p, sizeof(value));
+			return value;
+		}
+
+		static inline unsigned int read_u32(const unsigned char *p)
+		{
+			unsigned int value;
+			memcpy(&value, p, sizeof(value));
+			return value;
+		}
+
+		static std::string encode_base64(const std::string &raw)
+		{
+			static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+			std::string out;
+			out.reserve((raw.length() + 2) / 3 * 4);
+			for(size_t i = 0; i < raw.length(); i += 3) {
+				unsigned int chunk = (unsigned char)raw[i] << 16;
+				if(i + 1 < raw.length()) chunk |= (unsigned char)raw[i + 1] << 8;
+				if(i + 2 < raw.length()) chunk |= (unsigned char)raw[i + 2];
+				out.push_back(alphabet[(chunk >> 18) & 63]);
+				out.push_back(alphabet[(chunk >> 12) & 63]);
+				out.push_back(i + 1 < raw.length() ? alphabet[(chunk >> 6) & 63] : '=');
+				out.push_back(i + 2 < raw.length() ? alphabet[chunk & 63] : '=');
 			}
+			return out;
+		}
 
-			if(buffer_ == nullptr) {
-				buffer_ = new char[read_buffer_size];
+		static std::string encode_hex(const std::string &raw)
+		{
+			static const char digits[] = "0123456789abcdef";
+			std::string out;
+			out.reserve(raw.length() * 2);
+			for(unsigned char c : raw) {
+				out.push_back(digits[c >> 4]);
+				out.push_back(digits[c & 15]);
 			}
+			return out;
+		}
 
-			while(true) {
+		// Header carrying the digest of an outgoing body, empty where no header is defined for the algorithm
+		static std::string digest_header(digest_algorithm_t algorithm, const std::string &raw)
+		{
+			switch(algorithm) {
+			case digest_md5:
+				return "Content-MD5: " + encode_base64(raw);
+			case digest_sha256:
+				return "Repr-Digest: sha-256=:" + encode_base64(raw) + ":";
+			case digest_crc32c:
+				return "x-goog-hash: crc32c=" + encode_base64(raw);
+			default:
+				return std::string();
+			}
+		}
 
-				DWORD data_available;
-				if(!WH_INTERNET(QueryDataAvailable)(handle_, &data_available WH_WININET_ARGS(0, 0) )) {
-					THROW_LAST_ERROR("WinHttpQueryDataAvailable() failed");
-					return false;
+		static BCRYPT_ALG_HANDLE digest_providers[2];
+		static std::once_flag digest_providers_once;
+
+		static BCRYPT_ALG_HANDLE digest_provider(digest_algorithm_t algorithm)
+		{
+			std::call_once(digest_providers_once, [] {
+				if(!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&digest_providers[0], BCRYPT_SHA256_ALGORITHM, nullptr, 0))) {
+					digest_providers[0] = nullptr;
+				}
+				if(!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&digest_providers[1], BCRYPT_MD5_ALGORITHM, nullptr, 0))) {
+					digest_providers[1] = nullptr;
 				}
+			});
+			return digest_providers[algorithm == digest_sha256 ? 0 : 1];
+		}
 
-				if(data_available == 0) {
-					break;
+		// One upstream exchange that identical concurrent requests wait on
+		struct session_t::flight_t
+		{
+			flight_t() : done(false), shared(false), status(-1) {}
+			std::mutex mutex;
+			std::condition_variable ready;
+			bool done;
+			bool shared;
+			int status;
+			std::string headers;
+			std::shared_ptr<const std::string> body;
+		};
+
+		// Lands the leader's outcome on the flight even when the exchange throws, waiters fall back on their own
+		class flight_scope_t
+		{
+		public:
+			flight_scope_t(const session_t &session, const std::string &key, const std::shared_ptr<session_t::flight_t> &flight)
+				: session_(session), key_(key), flight_(flight), finished_(false) {}
+			~flight_scope_t() { finish(); }
+
+			void finish()
+			{
+				if(finished_) {
+					return;
+				}
+				finished_ = true;
+				{
+					std::lock_guard<std::mutex> lock(session_.flights_mutex_);
+					session_.flights_.erase(key_);
 				}
+				std::lock_guard<std::mutex> lock(flight_->mutex);
+				flight_->done = true;
+				flight_->ready.notify_all();
+			}
 
-				while(data_available > 0) {
-					DWORD bytes_read;
-					DWORD chunk_size = read_buffer_size < data_available ? read_buffer_size : data_available;
+		private:
+			const session_t &session_;
+			std::string key_;
+			std::shared_ptr<session_t::flight_t> flight_;
+			bool finished_;
+		};
 
-#ifdef WH_USE_WININET
-					if(!InternetReadFile(handle_, buffer_, chunk_size, &bytes_read)) {
-						THROW_LAST_ERROR("InternetReadFile() failed");
+		// Binds the shared pipeline to std::wstring/std::vector requests and the throwing error handler
+		struct core_traits_t
+		{
+			typedef request_t request_type;
+			typedef error_handler_t error_type;
+
+			static inline const wchar_t *method(const request_t &req) { return req.method_.c_str(); }
+			static inline const wchar_t *url(const request_t &req) { return req.url_.c_str(); }
+			static inline const char *body(const request_t &req) { return req.body_.data(); }
+			static inline DWORD body_length(const request_t &req) { return (DWORD)req.body_.length(); }
+			static inline unsigned int options(const request_t &req) { return req.flags_; }
+			static inline unsigned long long deadline(const request_t &req) { return req.deadline_; }
+
+			template <class F>
+			static bool each_header(const request_t &req, F f)
+			{
+				auto headers_end = std::end(req.additional_headers_);
+				for(auto iter = std::begin(req.additional_headers_); iter != headers_end; ++iter) {
+					if(!f(iter->c_str(), (DWORD)iter->length())) {
 						return false;
 					}
-#else
-					if(!WinHttpReadData(handle_, buffer_, chunk_size, &bytes_read)) {
-						THROW_LAST_ERROR("WinHttpReadData() failed");
-						return false;
+				}
+				return true;
+			}
+
+			static void fail(error_handler_t &errors, const char *phase, DWORD code)
+			{
+				errors.set_error(phase, code);
+#if _HAS_EXCEPTIONS
+				if(errors.throws_) {
+					if(code != 0) {
+						throw last_error_t(phase, code);
 					}
+					throw std::runtime_error(phase);
+				}
 #endif
+			}
+		};
 
-					out.write(buffer_, bytes_read);
-					data_available -= bytes_read;
-				}
+		typedef core::pipeline_t<core_traits_t> pipeline_t;
+
+		class cancel_scope_t
+		{
+		public:
+			cancel_scope_t(cancel_t *cancel, handle_manage_t &guard)
+				: cancel_(cancel),
+				guard_(guard),
+				attached_(cancel != nullptr && cancel->attach(guard.handle()))
+			{
+			}
+			cancel_scope_t(const cancel_scope_t &other) = delete;
+			~cancel_scope_t() { if(attached_ && !cancel_->detach()) guard_.set_handle(nullptr); }
+			inline bool attached() const { return attached_; }
+			inline void dismiss() { attached_ = false; }
+
+		private:
+			cancel_t *cancel_;
+			handle_manage_t &guard_;
+			bool attached_;
+		};
+
+		class limiter_slot_t
+		{
+		public:
+			limiter_slot_t(limiter_t *limiter, const std::string &host)
+				: limiter_(limiter),
+				host_(host),
+				acquired_(limiter == nullptr || limiter->acquire(host)),
+				succeeded_(false),
+				started_(now_microseconds())
+			{
+			}
+			limiter_slot_t(const limiter_slot_t &other) = delete;
+			~limiter_slot_t() { if(limiter_ != nullptr && acquired_) limiter_->release(host_, (unsigned int)(now_microseconds() - started_), succeeded_); }
+			inline bool acquired() const { return acquired_; }
+			inline void succeeded() { succeeded_ = true; }
+
+		private:
+			limiter_t *limiter_;
+			std::string host_;
+			bool acquired_;
+			bool succeeded_;
+			unsigned long long started_;
+		};
+
+		class scheduler_slot_t
+		{
+		public:
+			scheduler_slot_t(scheduler_t *scheduler, priority_t priority, unsigned long long deadline)
+				: scheduler_(scheduler),
+				acquired_(scheduler == nullptr || scheduler->acquire(priority, deadline))
+			{
+			}
+			scheduler_slot_t(const scheduler_slot_t &other) = delete;
+			~scheduler_slot_t() { if(scheduler_ != nullptr && acquired_) scheduler_->release(); }
+			inline bool acquired() const { return acquired_; }
+
+		private:
+			scheduler_t *scheduler_;
+			bool acquired_;
+		};
+
+		struct hedge_state_t
+		{
+			hedge_state_t() : launched(false) { done[0] = done[1] = false; phases[0] = phases[1] = nullptr; codes[0] = codes[1] = 0; }
+
+			std::mutex mutex;
+			std::condition_variable changed;
+			std::unique_ptr<response_t> results[2];
+			std::string errors[2];
+			const char *phases[2];
+			DWORD codes[2];
+			bool done[2];
+			bool launched;
+			cancel_t cancels[2];
+		};
+
+		// Failures of the connection itself, which another attempt may well get past. Rejections by the limiter or
+		// the scheduler, an expired deadline and a bad url carry no code and would only fail the same way again.
+		static bool transport_failure(DWORD code)
+		{
+			switch(code) {
+#ifndef WH_USE_WININET
+			case ERROR_WINHTTP_TIMEOUT:
+			case ERROR_WINHTTP_NAME_NOT_RESOLVED:
+			case ERROR_WINHTTP_CANNOT_CONNECT:
+			case ERROR_WINHTTP_CONNECTION_ERROR:
+			case ERROR_WINHTTP_INVALID_SERVER_RESPONSE:
+			case ERROR_WINHTTP_RESEND_REQUEST:
+#else
+			case ERROR_INTERNET_TIMEOUT:
+			case ERROR_INTERNET_NAME_NOT_RESOLVED:
+			case ERROR_INTERNET_CANNOT_CONNECT:
+			case ERROR_INTERNET_CONNECTION_ABORTED:
+			case ERROR_INTERNET_CONNECTION_RESET:
+			case ERROR_HTTP_INVALID_SERVER_RESPONSE:
+#endif
+				return true;
+			default:
+				return false;
+			}
+		}
+
+
+
+		handle_manage_t::handle_manage_t() : handle_(nullptr) {}
+		handle_manage_t::handle_manage_t(HINTERNET h) : handle_(h) {}
+		handle_manage_t::~handle_manage_t() { if(handle_ != nullptr) WH_INTERNET(CloseHandle)(handle_); }
+
+
+
+		cancel_t::cancel_t()
+			: handle_(nullptr),
+			cancelled_(false),
+			closed_(false)
+		{
+		}
+
+		void cancel_t::cancel()
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			cancelled_ = true;
+			if(handle_ != nullptr) {
+				// Closing the request handle is the only way to abort a blocking WinHTTP call from another thread
+				WH_INTERNET(CloseHandle)(handle_);
+				handle_ = nullptr;
+				closed_ = true;
+			}
+		}
+
+		bool cancel_t::cancelled() const
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			return cancelled_;
+		}
+
+		bool cancel_t::attach(HINTERNET h)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if(cancelled_) {
+				return false;
+			}
+			handle_ = h;
+			closed_ = false;
+			return true;
+		}
+
+		bool cancel_t::detach()
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			bool owned = !closed_;
+			handle_ = nullptr;
+			closed_ = false;
+			return owned;
+		}
+
+
+
+
+		retry_budget_t::retry_budget_t(double ratio, double min_per_second)
+			: ratio_(ratio),
+			min_per_second_(min_per_second),
+			max_tokens_(min_per_second * 10.0 + ratio * 1000.0),
+			tokens_(min_per_second),
+			last_refill_(GetTickCount64())
+		{
+		}
+
+		void retry_budget_t::refill()
+		{
+			// min_per_second_ trickles in regardless of traffic so a quiet client can still retry
+			unsigned long long now = GetTickCount64();
+			tokens_ += (double)(now - last_refill_) / 1000.0 * min_per_second_;
+			if(tokens_ > max_tokens_) {
+				tokens_ = max_tokens_;
+			}
+			last_refill_ = now;
+		}
+
+		void retry_budget_t::deposit()
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			refill();
+			tokens_ += ratio_;
+			if(tokens_ > max_tokens_) {
+				tokens_ = max_tokens_;
+			}
+		}
+
+		bool retry_budget_t::withdraw()
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			refill();
+			if(tokens_ < 1.0) {
+				return false;
+			}
+			tokens_ -= 1.0;
+			return true;
+		}
+
+
+
+
+		policy_t::policy_t()
+			: hedging_(true),
+			hedge_quantile_(0.95),
+			hedge_min_delay_(10),
+			max_retries_(2),
+			backoff_base_(50),
+			backoff_cap_(1000)
+		{
+		}
+
+
+
+
+		limiter_t::limiter_t(unsigned int initial_limit, unsigned int min_limit, unsigned int max_limit)
+			: initial_limit_(initial_limit),
+			min_limit_(min_limit > 0 ? min_limit : 1),
+			max_limit_(max_limit),
+			tolerance_(2.0),
+			rate_(0.0),
+			burst_(0.0),
+			queue_timeout_(1000)
+		{
+		}
+
+		void limiter_t::set_rate(double requests_per_second, double burst)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			rate_ = requests_per_second;
+			burst_ = burst >= 1.0 ? burst : 1.0;
+		}
+
+		unsigned int limiter_t::limit(const std::string &host) const
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			auto found = hosts_.find(host);
+			return found == hosts_.end() ? initial_limit_ : (unsigned int)found->second.limit;
+		}
+
+		bool limiter_t::acquire(const std::string &host)
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			auto found = hosts_.find(host);
+			if(found == hosts_.end()) {
+				host_t fresh;
+				fresh.limit = initial_limit_;
+				fresh.tokens = burst_;
+				fresh.last_refill = now_microseconds();
+				found = hosts_.insert(std::make_pair(host, fresh)).first;
+			}
+			host_t &state = found->second;
+
+			// Wait in line rather than fail outright, but only for so long; piling up blocked callers is what we're avoiding
+			unsigned long long deadline = now_microseconds() + (unsigned long long)queue_timeout_ * 1000;
+			while(true) {
+				unsigned long long now = now_microseconds();
+				unsigned long long wait = deadline > now ? deadline - now : 0;
+				if(rate_ > 0.0) {
+					state.tokens += (double)(now - state.last_refill) / 1000000.0 * rate_;
+					state.tokens = state.tokens < burst_ ? state.tokens : burst_;
+					state.last_refill = now;
+				}
+
+				bool has_slot = state.in_flight < (unsigned int)state.limit;
+				bool has_token = rate_ <= 0.0 || state.tokens >= 1.0;
+				if(has_slot && has_token) {
+					++state.in_flight;
+					if(rate_ > 0.0) {
+						state.tokens -= 1.0;
+					}
+					return true;
+				}
+				if(wait == 0) {
+					return false;
+				}
+
+				if(has_slot) {
+					// Only short of a token; sleep until the next one is due
+					unsigned long long due = (unsigned long long)((1.0 - state.tokens) / rate_ * 1000000.0) + 1;
+					wait = due < wait ? due : wait;
+				}
+				available_.wait_for(lock, std::chrono::microseconds(wait));
+			}
+		}
+
+		void limiter_t::release(const std::string &host, unsigned int microseconds, bool succeeded)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			host_t &state = hosts_[host];
+			--state.in_flight;
+
+			// Baseline is a slowly rising minimum, so it tracks the unloaded latency rather than the current one
+			if(state.baseline == 0.0 || microseconds < state.baseline) {
+				state.baseline = microseconds;
+			} else {
+				state.baseline += (microseconds - state.baseline) * 0.01;
+			}
+
+			// AIMD: grow by one per window of on-time completions, back off multiplicatively once queueing shows
+			if(!succeeded || microseconds > state.baseline * tolerance_) {
+				state.limit *= 0.9;
+			} else if(state.in_flight + 1 >= (unsigned int)state.limit / 2) {
+				state.limit += 1.0 / state.limit;
+			}
+			if(state.limit < min_limit_) {
+				state.limit = min_limit_;
+			} else if(max_limit_ > 0 && state.limit > max_limit_) {
+				state.limit = max_limit_;
+			}
+			available_.notify_all();
+		}
+
+
+		scheduler_t::scheduler_t(unsigned int slots, unsigned int reserved, unsigned int aging)
+			: slots_(slots > 0 ? slots : 1),
+			reserved_(reserved < slots ? reserved : 0),
+			aging_(aging),
+			in_flight_(0),
+			next_ticket_(0),
+			queue_timeout_(30000)
+		{
+		}
+
+		unsigned int scheduler_t::in_flight() const
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			return in_flight_;
+		}
+
+		unsigned int scheduler_t::waiting() const
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			return (unsigned int)waiting_.size();
+		}
+
+		bool scheduler_t::admits(priority_t priority) const
+		{
+			// Aging decides the order, but only the request's own class gets into the reserved slots
+			return in_flight_ < slots_ - reserved_ || (priority == priority_interactive && in_flight_ < slots_);
+		}
+
+		void scheduler_t::grant()
+		{
+			unsigned long long now = GetTickCount64();
+			while(!waiting_.empty()) {
+				// Highest effective class first, the oldest ticket within it
+				waiter_t *best = nullptr;
+				unsigned long long best_rank = 0;
+				for(waiter_t *waiter : waiting_) {
+					unsigned long long aged = aging_ > 0 ? (now - waiter->enqueued) / aging_ : 0;
+					unsigned long long rank = waiter->priority + aged;
+					rank = rank < priority_interactive ? rank : priority_interactive;
+					if(best == nullptr || rank > best_rank || (rank == best_rank && waiter->ticket < best->ticket)) {
+						best = waiter;
+						best_rank = rank;
+					}
+				}
+				if(!admits(best->priority)) {
+					// Only reserved slots are left, and those go to the oldest interactive request
+					auto interactive = std::find_if(waiting_.begin(), waiting_.end(), [](waiter_t *waiter) { return waiter->priority == priority_interactive; });
+					if(interactive == waiting_.end() || !admits(priority_interactive)) {
+						return;
+					}
+					best = *interactive;
+				}
+				best->granted = true;
+				++in_flight_;
+				waiting_.erase(std::find(waiting_.begin(), waiting_.end(), best));
+				changed_.notify_all();
+			}
+		}
+
+		bool scheduler_t::acquire(priority_t priority, unsigned long long deadline)
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			if(waiting_.empty() && admits(priority)) {
+				++in_flight_;
+				return true;
+			}
+
+			waiter_t self;
+			self.ticket = next_ticket_++;
+			self.priority = priority;
+			self.enqueued = GetTickCount64();
+			self.granted = false;
+			waiting_.push_back(&self);
+			grant();
+
+			unsigned long long give_up = self.enqueued + queue_timeout_;
+			if(deadline != 0 && deadline < give_up) {
+				give_up = deadline;
+			}
+			while(!self.granted) {
+				unsigned long long now = GetTickCount64();
+				if(now >= give_up) {
+					waiting_.erase(std::find(waiting_.begin(), waiting_.end(), &self));
+					return false;
+				}
+				// Wake up at least once per aging interval so promotions are noticed
+				unsigned long long wait = give_up - now;
+				if(aging_ > 0 && wait > aging_) {
+					wait = aging_;
+				}
+				changed_.wait_for(lock, std::chrono::milliseconds(wait));
+				if(!self.granted) {
+					grant();
+				}
+			}
+			return true;
+		}
+
+		void scheduler_t::release()
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			--in_flight_;
+			grant();
+		}
+
+
+
+
+
+		session_t::session_t(const std::string &user_agent)
+			: read_chunk_size_(response_t::default_read_chunk_size),
+			coalescing_(false),
+			coalesce_max_body_(0)
+		{
+			std::wstring wide_user_agent = std::wstring(std::begin(user_agent), std::end(user_agent));
+			handle_ = WH_INTERNETW(Open)(wide_user_agent.c_str(), 0, nullptr, nullptr, 0);
+			if(handle_ == nullptr) {
+				THROW_LAST_ERROR("WinHttpOpen() failed");
+				return;
+			}
+
+#ifndef WH_USE_WININET
+			// Let WinHTTP race IPv6 against IPv4 (RFC 8305) rather than wait out the connect timeout on broken IPv6.
+			// Older systems reject the option, and then simply keep their sequential behaviour.
+			DWORD fast_fallback = TRUE;
+			WinHttpSetOption(handle_, WINHTTP_OPTION_IPV6_FAST_FALLBACK, &fast_fallback, sizeof(fast_fallback));
+#endif
+		}
+
+		session_t::~session_t()
+		{
+			for(char *buffer : buffers_) {
+				delete[] buffer;
+			}
+		}
+
+		request_t session_t::acquire_request(const std::string &method, const std::string &url) const
+		{
+			{
+				std::lock_guard<std::mutex> lock(pool_mutex_);
+				if(!requests_.empty()) {
+					request_t req(std::move(requests_.back()));
+					requests_.pop_back();
+					req.reset(method, url);
+					return req;
+				}
+			}
+			return request_t(method, url);
+		}
+
+		void session_t::recycle(request_t &&req) const
+		{
+			// A request on a caller's arena must not outlive it in the session-wide pool
+			if(req.resource() != default_resource()) {
+				return;
+			}
+			std::lock_guard<std::mutex> lock(pool_mutex_);
+			if(requests_.size() < request_pool_size) {
+				requests_.push_back(std::move(req));
+			}
+		}
+
+		void session_t::recycle(response_t &&resp) const
+		{
+			resp.reset();
+			if(resp.buffer_ == nullptr || resp.resource_ != nullptr) {
+				return;
+			}
+			std::lock_guard<std::mutex> lock(pool_mutex_);
+			if(buffers_.size() < buffer_pool_size && resp.buffer_size_ == read_chunk_size_) {
+				buffers_.push_back(resp.buffer_);
+				resp.buffer_ = nullptr;
+			}
+		}
+
+		size_t session_t::pooled_requests() const
+		{
+			std::lock_guard<std::mutex> lock(pool_mutex_);
+			return requests_.size();
+		}
+
+		size_t session_t::pooled_buffers() const
+		{
+			std::lock_guard<std::mutex> lock(pool_mutex_);
+			return buffers_.size();
+		}
+
+		void session_t::set_coalescing(bool on, const std::vector<std::string> &headers, size_t max_body)
+		{
+			coalescing_ = on;
+			coalesce_headers_ = headers;
+			coalesce_max_body_ = max_body;
+		}
+
+		bool session_t::set_tcp_fast_open(bool on)
+		{
+			if(!core::set_tcp_fast_open(handle_, on)) {
+				THROW_LAST_ERROR("WinHttpSetOption(WINHTTP_OPTION_TCP_FAST_OPEN) failed");
+				return false;
+			}
+			return true;
+		}
+
+		bool session_t::set_keepalive(bool on, unsigned int idle_ms, unsigned int interval_ms)
+		{
+			if(!core::set_tcp_keepalive(handle_, on, idle_ms, interval_ms)) {
+				THROW_LAST_ERROR("WinHttpSetOption(WINHTTP_OPTION_TCP_KEEPALIVE) failed");
+				return false;
+			}
+			return true;
+		}
+
+		bool session_t::set_max_connections(unsigned int per_server)
+		{
+			if(!core::set_max_connections(handle_, per_server)) {
+				THROW_LAST_ERROR("WinHttpSetOption(WINHTTP_OPTION_MAX_CONNS_PER_SERVER) failed");
+				return false;
+			}
+			return true;
+		}
+
+		bool session_t::set_read_chunk_size(size_t bytes)
+		{
+			if(bytes < min_read_chunk_size || bytes > max_read_chunk_size) {
+				THROW_ERROR("read chunk size must be between 4K and 16M");
+				return false;
+			}
+
+			// Pooled buffers have the old size; responses holding one keep it until they are recycled
+			std::lock_guard<std::mutex> lock(pool_mutex_);
+			read_chunk_size_ = bytes;
+			for(char *buffer : buffers_) {
+				delete[] buffer;
+			}
+			buffers_.clear();
+			return true;
+		}
+
+		size_t session_t::read_chunk_size() const
+		{
+			std::lock_guard<std::mutex> lock(pool_mutex_);
+			return read_chunk_size_;
+		}
+
+		char *session_t::acquire_buffer(size_t &size) const
+		{
+			{
+				std::lock_guard<std::mutex> lock(pool_mutex_);
+				size = read_chunk_size_;
+				if(!buffers_.empty()) {
+					char *buffer = buffers_.back();
+					buffers_.pop_back();
+					return buffer;
+				}
+			}
+			return new char[size];
+		}
+
+		bool session_t::resolve(const std::string &host, std::vector<std::string> &addresses) const
+		{
+			// No cache of our own: the DNS client keeps answers for their TTL, and it is the same cache WinHTTP
+			// resolves against, so a lookup here is what saves the first request the wait. IPv6 answers come first.
+			static const WORD types[] = { DNS_TYPE_AAAA, DNS_TYPE_A };
+			std::wstring wide_host(std::begin(host), std::end(host));
+			addresses.clear();
+			for(size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+				PDNS_RECORD records = nullptr;
+				if(DnsQuery_W(wide_host.c_str(), types[i], DNS_QUERY_STANDARD, nullptr, &records, nullptr) != 0) {
+					continue;
+				}
+
+				for(PDNS_RECORD record = records; record != nullptr; record = record->pNext) {
+					char text[48];
+					if(record->wType == DNS_TYPE_A) {
+						const BYTE *b = (const BYTE *)&record->Data.A.IpAddress;
+						sprintf_s(text, sizeof(text), "%u.%u.%u.%u", b[0], b[1], b[2], b[3]);
+					} else if(record->wType == DNS_TYPE_AAAA) {
+						const BYTE *b = record->Data.AAAA.Ip6Address.IP6Byte;
+						sprintf_s(text, sizeof(text), "%x:%x:%x:%x:%x:%x:%x:%x", (b[0] << 8) | b[1], (b[2] << 8) | b[3], (b[4] << 8) | b[5],
+							(b[6] << 8) | b[7], (b[8] << 8) | b[9], (b[10] << 8) | b[11], (b[12] << 8) | b[13], (b[14] << 8) | b[15]);
+					} else {
+						continue;
+					}
+					addresses.push_back(text);
+				}
+				DnsRecordListFree(records, DnsFreeRecordList);
+			}
+			return !addresses.empty();
+		}
+
+
+
+
+
+
+		void session_t::record_latency(const std::string &host, unsigned int microseconds) const
+		{
+			std::lock_guard<std::mutex> lock(latency_mutex_);
+			latency_window_t &window = latencies_[host];
+			if(window.samples.size() < latency_window_size) {
+				window.samples.push_back(microseconds);
+			} else {
+				window.samples[window.next] = microseconds;
+				window.next = (window.next + 1) % latency_window_size;
+			}
+		}
+
+		bool session_t::latency_quantile(const std::string &host, double quantile, unsigned int &microseconds) const
+		{
+			std::vector<unsigned int> samples;
+			{
+				std::lock_guard<std::mutex> lock(latency_mutex_);
+				auto found = latencies_.find(host);
+				// Too few samples say nothing about the tail
+				if(found == latencies_.end() || found->second.samples.size() < 16) {
+					return false;
+				}
+				samples = found->second.samples;
+			}
+
+			size_t index = (size_t)(quantile * (samples.size() - 1));
+			std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+			microseconds = samples[index];
+			return true;
+		}
+
+
+
+
+		connection_t::connection_t(const session_t &sess, const std::string &host)
+			: session_(sess),
+			origin_(host),
+			flags_(0),
+			timeout_(30),
+			cache_(nullptr),
+			policy_(nullptr),
+			limiter_(nullptr),
+			scheduler_(nullptr),
+			replay_(nullptr)
+		{
+			host_ = std::wstring(std::begin(host), std::end(host));
+
+			memset(&components_, 0, sizeof(components_));
+			components_.dwStructSize = sizeof(components_);
+			components_.dwSchemeLength = -1;
+			components_.dwHostNameLength = -1;
+
+			if(!WH_INTERNETW(CrackUrl)(host_.c_str(), 0, 0, &components_)) {
+				THROW_LAST_ERROR("WinHttpCrackUrl() failed");
+				return;
+			}
+
+			std::wstring host_only(components_.lpszHostName, components_.dwHostNameLength);
+#ifdef WH_USE_WININET
+			handle_ = InternetConnectW(sess.handle(), host_only.c_str(), components_.nPort, nullptr, nullptr, INTERNET_SERVICE_HTTP, 0, 0);
+#else
+			handle_ = WinHttpConnect(sess.handle(), host_only.c_str(), components_.nPort, 0);
+#endif
+			if(handle_ == nullptr) {
+				THROW_LAST_ERROR("WinHttpConnect() failed");
+				return;
+			}
+		}
+
+		connection_t::~connection_t()
+		{
+		}
+
+		void connection_t::set_option(option_t opt, bool on)
+		{
+			if(on) {
+				flags_ |= (1u << opt);
+			} else {
+				flags_ &= ~(1u << opt);
+			}
+		}
+
+		response_t connection_t::send(const request_t &req)
+		{
+			// Errors belong to one call, an earlier failure must not fail this one
+			clear_error();
+			if(session_.coalescing_) {
+				return send_coalesced(req);
+			}
+			return send_direct(req);
+		}
+
+		response_t connection_t::send_direct(const request_t &req)
+		{
+			if(cache_ != nullptr) {
+				return send_cached(req);
+			}
+			return dispatch(req);
+		}
+
+		response_t connection_t::send_coalesced(const request_t &req)
+		{
+			// Only bodiless reads whose answer does not depend on what the caller already holds can be shared
+			std::string ignored;
+			if((req.method_ != L"GET" && req.method_ != L"HEAD") || !req.body_.empty() ||
+				req.header("Range", ignored) || req.header("If-None-Match", ignored) || req.header("If-Modified-Since", ignored)) {
+				return send_direct(req);
+			}
+
+			// Certificate options are part of the key, a strictly checked request must never get an answer fetched without checks
+			std::string key = std::string(std::begin(req.method_), std::end(req.method_)) + " " + target(req) + " " + std::to_string(flags_ | req.flags_);
+			for(auto &name : session_.coalesce_headers_) {
+				std::string value;
+				key += "\n";
+				if(req.header(name, value)) {
+					key += value;
+				}
+			}
+
+			std::shared_ptr<session_t::flight_t> flight;
+			bool leader = false;
+			{
+				std::lock_guard<std::mutex> lock(session_.flights_mutex_);
+				auto found = session_.flights_.find(key);
+				if(found != session_.flights_.end()) {
+					flight = found->second;
+				}
+				else {
+					flight = std::make_shared<session_t::flight_t>();
+					session_.flights_[key] = flight;
+					leader = true;
+				}
+			}
+
+			if(!leader) {
+				// Waits no longer than the waiter's own deadline or, without one, the connection timeout
+				unsigned long long wait = (unsigned long long)timeout_ * 1000;
+				if(req.deadline_ != 0) {
+					unsigned long long now = GetTickCount64();
+					wait = req.deadline_ > now ? req.deadline_ - now : 0;
+				}
+				bool done = false;
+				{
+					std::unique_lock<std::mutex> lock(flight->mutex);
+					done = flight->ready.wait_for(lock, std::chrono::milliseconds(wait), [&flight] { return flight->done; });
+				}
+				if(done && flight->shared) {
+					return response_t(flight->status, flight->headers, flight->body, throws_);
+				}
+				// The leader failed, took too long or the body was too large to hold, everyone goes on their own
+				return send_direct(req);
+			}
+
+			flight_scope_t scope(session_, key, flight);
+			response_t resp = send_direct(req);
+			// Only a body known to end within the limit is worth holding; a stream (SSE, long-poll) or one without a
+			// Content-Length goes back to the leader untouched, and the waiters are let go at once to send their own
+			bool buffered = resp.handle_ == nullptr && resp.body_ && !resp.headers_.empty();
+			std::string content_length;
+			bool bounded = req.method_ == L"HEAD" ||
+				(resp.header("Content-Length", content_length) && strtoull(content_length.c_str(), nullptr, 10) <= session_.coalesce_max_body_);
+			if(resp.ok() && (buffered || (bounded && resp.buffer_body(session_.coalesce_max_body_)))) {
+				std::lock_guard<std::mutex> lock(flight->mutex);
+				flight->shared = true;
+				flight->status = resp.status_;
+				flight->headers = resp.headers_;
+				flight->body = resp.body_;
+			}
+			scope.finish();
+			return resp;
+		}
+
+#ifndef WH_USE_WININET
+		websocket_t connection_t::upgrade_websocket(const request_t &req)
+		{
+			clear_error();
+			// Bypasses cache, policy and limiter, none of them make sense for a socket that stays open
+			handle_manage_t request_t(pipeline_t::open(handle_, components_, req, *this));
+			if(request_t == nullptr) {
+				return websocket_t(nullptr, throws_, *this);
+			}
+
+			if(!pipeline_t::prepare(request_t, req, flags_, timeout_, *this)) {
+				return websocket_t(nullptr, throws_, *this);
+			}
+
+			if(!WinHttpSetOption(request_t, WINHTTP_OPTION_UPGRADE_TO_WEB_SOCKET, nullptr, 0)) {
+				THROW_LAST_ERROR("WinHttpSetOption(WINHTTP_OPTION_UPGRADE_TO_WEB_SOCKET) failed");
+				return websocket_t(nullptr, throws_, *this);
+			}
+
+			if(!pipeline_t::send(request_t, req, *this)) {
+				return websocket_t(nullptr, throws_, *this);
+			}
+
+			if(!WinHttpReceiveResponse(request_t, nullptr)) {
+				THROW_LAST_ERROR("WinHttpReceiveResponse() failed");
+				return websocket_t(nullptr, throws_, *this);
+			}
+
+			int status = 0;
+			if(!pipeline_t::status(request_t, status, *this)) {
+				return websocket_t(nullptr, throws_, *this);
+			}
+			if(status != 101) {
+				THROW_ERROR("server did not switch protocols, status " + std::to_string(status));
+				return websocket_t(nullptr, throws_, *this);
+			}
+
+			HINTERNET socket = WinHttpWebSocketCompleteUpgrade(request_t, 0);
+			if(socket == nullptr) {
+				THROW_LAST_ERROR("WinHttpWebSocketCompleteUpgrade() failed");
+			}
+			// The request handle is closed on the way out, the websocket handle stands on its own
+			return websocket_t(socket, throws_, *this);
+		}
+#endif
+
+		response_t connection_t::try_send(const request_t &req)
+		{
+			// Same pipeline as send(), but failures come back on the response instead of being thrown
+			bool throws = throws_;
+			throws_ = false;
+			response_t resp = send(req);
+			throws_ = throws;
+			resp.throws_ = false;
+			if(!ok() && resp.ok()) {
+				resp.take_error(*this);
+			}
+			return resp;
+		}
+
+		response_t connection_t::dispatch(const request_t &req)
+		{
+			if(policy_ != nullptr) {
+				return send_with_policy(req);
+			}
+			return transmit(req);
+		}
+
+		void connection_t::inherit_settings(const connection_t &other)
+		{
+			flags_ = other.flags_;
+			timeout_ = other.timeout_;
+			limiter_ = other.limiter_;
+			scheduler_ = other.scheduler_;
+			replay_ = other.replay_;
+			throws_ = other.throws_;
+		}
+
+		std::string connection_t::authority() const
+		{
+			return std::string(components_.lpszHostName, components_.lpszHostName + components_.dwHostNameLength) + ":" + std::to_string(components_.nPort);
+		}
+
+		std::string connection_t::target(const request_t &req) const
+		{
+			// scheme://host:port/path?query, the same whether the request_t url was absolute or relative
+			std::wstring path(std::begin(req.url_), std::end(req.url_));
+			URL_COMPONENTSW url_comps;
+			memset(&url_comps, 0, sizeof(url_comps));
+			url_comps.dwStructSize = sizeof(url_comps);
+			url_comps.dwUrlPathLength = -1;
+			if(WH_INTERNETW(CrackUrl)(req.url_.c_str(), 0, 0, &url_comps)) {
+				path = url_comps.lpszUrlPath;
+			}
+			return std::string(components_.lpszScheme, components_.lpszScheme + components_.dwSchemeLength) + "://" +
+				std::string(components_.lpszHostName, components_.lpszHostName + components_.dwHostNameLength) + ":" +
+				std::to_string(components_.nPort) + std::string(std::begin(path), std::end(path));
+		}
+
+		response_t connection_t::transmit(const request_t &req, cancel_t *cancel)
+		{
+			std::unique_ptr<scheduler_slot_t> scheduled(new scheduler_slot_t(scheduler_, req.priority_, req.deadline_));
+			if(!scheduled->acquired()) {
+				THROW_ERROR("scheduler_t gave up on the request, no slot opened before its deadline");
+				return response_t(nullptr);
+			}
+
+			std::unique_ptr<limiter_slot_t> slot(new limiter_slot_t(limiter_, authority()));
+			if(!slot->acquired()) {
+				THROW_ERROR("limiter_t rejected the request, the host is at its concurrency limit");
+				return response_t(nullptr);
+			}
+
+			std::string replay_key;
+			if(replay_ != nullptr) {
+				replay_key = std::string(std::begin(req.method_), std::end(req.method_)) + " " + target(req);
+				if(!req.body_.empty()) {
+					char crc[16];
+					sprintf_s(crc, sizeof(crc), " %08x", crc32c_update(0, (const unsigned char *)req.body_.data(), req.body_.length()));
+					replay_key += crc;
+				}
+			}
+
+			if(replay_ != nullptr && replay_->mode() == replay_t::mode_replay) {
+				replay_t::entry_t entry;
+				if(!replay_->play(replay_key, entry)) {
+					THROW_ERROR("replay_t has no recorded exchange left for " + replay_key);
+					return response_t(nullptr);
+				}
+				if(replay_->timed_) {
+					std::this_thread::sleep_for(std::chrono::microseconds(entry.elapsed));
+				}
+				response_t resp(entry.status, std::string(entry.headers, entry.headers_length),
+					std::make_shared<const std::string>(entry.body, (size_t)entry.body_length), throws_);
+				if(req.digest_ != digest_none) {
+					// Playback stands in for the wire, so the body is hashed as if it had been read off it
+					resp.digest_.reset(new digest_t(req.digest_));
+					resp.digest_->update(entry.body, (size_t)entry.body_length);
+				}
+				if(resp.status() != 429 && resp.status() != 503) {
+					slot->succeeded();
+				}
+				return resp;
+			}
+
+			unsigned long long started = now_microseconds();
+			handle_manage_t request_t(pipeline_t::open(handle_, components_, req, *this));
+			if(request_t == nullptr) {
+				return response_t(nullptr);
+			}
+
+			cancel_scope_t cancel_scope(cancel, request_t);
+			if(cancel != nullptr && !cancel_scope.attached()) {
+				THROW_ERROR("request cancelled");
+				return response_t(nullptr);
+			}
+
+			if(!pipeline_t::prepare(request_t, req, flags_, timeout_, *this)) {
+				return response_t(nullptr);
+			}
+
+			if(req.digest_ != digest_none && !req.body_.empty()) {
+				// The header goes out ahead of the body, so the body is hashed here once before it is written
+				digest_t body_digest(req.digest_);
+				body_digest.update(req.body_.data(), req.body_.length());
+				std::string line = digest_header(req.digest_, body_digest.finish());
+				if(!line.empty()) {
+					std::wstring wide_line(std::begin(line), std::end(line));
+					if(!WH_HTTPW(AddRequestHeaders)(request_t, wide_line.c_str(), (DWORD)wide_line.length(), WH_HTTP_CONST(ADDREQ_FLAG_ADD) | WH_HTTP_CONST(ADDREQ_FLAG_REPLACE))) {
+						THROW_LAST_ERROR("WinHttpAddRequestHeaders() failed");
+						return response_t(nullptr);
+					}
+				}
+			}
+
+			if(!pipeline_t::send(request_t, req, *this)) {
+				return response_t(nullptr);
+			}
+
+			// From here the response owns the handle, and takes over detaching it from cancel
+			cancel_scope.dismiss();
+			HINTERNET h = request_t.handle();
+			request_t.set_handle(nullptr);
+			response_t resp(h, cancel, req.deadline_, core::timeout_milliseconds(timeout_));
+			resp.throws_ = throws_;
+			resp.pool_ = &session_;
+			if(req.digest_ != digest_none) {
+				resp.digest_.reset(new digest_t(req.digest_));
+			}
+			// The read buffer comes from wherever the request's own storage did, unless that is the plain heap
+			resp.resource_ = req.resource() != default_resource() ? req.resource() : nullptr;
+			if(!resp.ok()) {
+				take_error(resp);
+#if _HAS_EXCEPTIONS
+				if(throws_) {
+					throw last_error_t(phase_ != nullptr ? phase_ : error().c_str(), code_);
+				}
+#endif
+			}
+			if(resp.ok() && replay_ != nullptr && resp.buffer_body(replay_t::max_body_size)) {
+				// The whole exchange, body included, is what gets replayed; too large a body is simply not recorded
+				replay_->record(replay_key, resp.status(), resp.headers_, *resp.body_, (unsigned int)(now_microseconds() - started));
+			}
+			if(resp.ok()) {
+				session_.record_latency(authority(), (unsigned int)(now_microseconds() - started));
+				// Overload shows up as 429/503 as often as it does as latency
+				if(resp.status() != 429 && resp.status() != 503) {
+					slot->succeeded();
+				}
+				// The body still occupies the connection, so the slots go with the response until it has been read
+				if(resp.handle_ != nullptr) {
+					resp.scheduled_ = std::move(scheduled);
+					resp.limited_ = std::move(slot);
+				}
+			}
+			return resp;
+		}
+
+		response_t connection_t::send_with_policy(const request_t &req)
+		{
+			static const wchar_t *idempotent_methods[] = { L"GET", L"HEAD", L"OPTIONS", L"PUT", L"DELETE", L"TRACE" };
+			bool idempotent = false;
+			for(size_t i = 0; i < sizeof(idempotent_methods) / sizeof(idempotent_methods[0]); ++i) {
+				idempotent = idempotent || req.method_ == idempotent_methods[i];
+			}
+			if(!idempotent) {
+				return transmit(req);
+			}
+
+			policy_->budget().deposit();
+			std::minstd_rand random((unsigned int)now_microseconds());
+			for(unsigned int attempt = 0;; ++attempt) {
+				std::string error;
+				const char *phase = nullptr;
+				DWORD code = 0;
+				response_t resp = hedged_attempt(req, error, phase, code);
+				bool retryable = error.empty() ? resp.status() == 502 || resp.status() == 503 || resp.status() == 504 : transport_failure(code);
+				if(req.deadline_ != 0 && GetTickCount64() >= req.deadline_) {
+					retryable = false;
+				}
+				if(!retryable || attempt >= policy_->max_retries() || !policy_->budget().withdraw()) {
+					if(!error.empty() && phase != nullptr) {
+						// Raised just as it would have been without a policy, so the code still tells a timeout from a failed lookup
+						set_error(phase, code);
+#if _HAS_EXCEPTIONS
+						if(throws_) {
+							if(code != 0) {
+								throw last_error_t(phase_, code_);
+							}
+							throw std::runtime_error(error_handler_t::error());
+						}
+#endif
+					}
+					else if(!error.empty()) {
+						THROW_ERROR(error);
+					}
+					return resp;
+				}
+
+				// Full jitter: anywhere between zero and the capped exponential bound
+				unsigned long long bound = (unsigned long long)policy_->backoff_base() << (attempt < 20 ? attempt : 20);
+				if(bound > policy_->backoff_cap()) {
+					bound = policy_->backoff_cap();
+				}
+				Sleep((DWORD)(random() % (bound + 1)));
+			}
+		}
+
+		response_t connection_t::hedged_attempt(const request_t &req, std::string &error, const char *&phase, DWORD &code)
+		{
+			hedge_state_t state;
+			std::thread hedge;
+
+			// Hedge once the first attempt is slower than the chosen quantile of recent requests to this host. Only then
+			// is there a second thread, and only once it fires does it open a connect handle of its own.
+			unsigned int quantile = 0;
+			if(policy_->hedging() && session_.latency_quantile(authority(), policy_->hedge_quantile(), quantile)) {
+				unsigned int delay = quantile / 1000 > policy_->hedge_min_delay() ? quantile / 1000 : policy_->hedge_min_delay();
+				hedge = std::thread([this, &req, &state, delay]() {
+					{
+						std::unique_lock<std::mutex> lock(state.mutex);
+						if(state.changed.wait_for(lock, std::chrono::milliseconds(delay), [&state]() { return state.done[0]; }) || !policy_->budget().withdraw()) {
+							return;
+						}
+						state.launched = true;
+					}
+
+					std::unique_ptr<response_t> result;
+					std::string failure;
+					const char *failure_phase = nullptr;
+					DWORD failure_code = 0;
+#if _HAS_EXCEPTIONS
+					try {
+#endif
+						// A separate connect handle keeps the attempts from sharing error state; WinHTTP pools the sockets.
+						// It never throws, so its failure keeps its phase and code for send_with_policy to raise.
+						connection_t conn(session_, origin_);
+						conn.inherit_settings(*this);
+						conn.throws_ = false;
+						if(conn.ok()) {
+							result.reset(new response_t(conn.transmit(req, &state.cancels[1])));
+						}
+						if(!conn.ok()) {
+							failure = conn.error();
+							failure_phase = conn.phase();
+							failure_code = conn.code();
+						}
+#if _HAS_EXCEPTIONS
+					} catch(const std::exception &e) {
+						failure = e.what();
+					}
+#endif
+					if(failure.empty()) {
+						state.cancels[0].cancel();
+					}
+					std::lock_guard<std::mutex> lock(state.mutex);
+					state.results[1] = std::move(result);
+					state.errors[1] = failure;
+					state.phases[1] = failure_phase;
+					state.codes[1] = failure_code;
+					state.done[1] = true;
+					state.changed.notify_all();
+				});
+			}
+
+			clear_error();
+			std::unique_ptr<response_t> result;
+			std::string failure;
+#if _HAS_EXCEPTIONS
+			try {
+#endif
+				result.reset(new response_t(transmit(req, &state.cancels[0])));
+				if(!ok()) {
+					failure = error_handler_t::error();
+				}
+#if _HAS_EXCEPTIONS
+			} catch(const std::exception &e) {
+				failure = e.what();
+			}
+#endif
+
+			int winner = 0;
+			{
+				std::unique_lock<std::mutex> lock(state.mutex);
+				state.results[0] = std::move(result);
+				state.errors[0] = failure;
+				state.phases[0] = phase_;
+				state.codes[0] = code_;
+				state.done[0] = true;
+				state.changed.notify_all();
+
+				// First success wins; if both fail, report the hedge's failure
+				if(state.launched && !failure.empty()) {
+					state.changed.wait(lock, [&state]() { return state.done[1]; });
+					winner = 1;
+				}
+			}
+			if(winner == 0) {
+				state.cancels[1].cancel();
+			}
+			if(hedge.joinable()) {
+				hedge.join();
+			}
+
+			// The first attempt ran on this connection; a hedge that won leaves nothing behind here
+			clear_error();
+			error = state.errors[winner];
+			phase = state.phases[winner];
+			code = state.codes[winner];
+			if(!state.results[winner]) {
+				return response_t(nullptr);
+			}
+			state.results[winner]->throws_ = throws_;
+			return std::move(*state.results[winner]);
+		}
+
+		response_t connection_t::send_cached(const request_t &req)
+		{
+			// Certificate options are part of the key, as for coalescing; an answer fetched without checks must not reach a strict request
+			static const unsigned int certificate_flags = (1u << option_allow_unknown_cert_authority) |
+				(1u << option_allow_invalid_cert_name) | (1u << option_allow_invalid_cert_date);
+			std::string key = target(req) + " " + std::to_string((flags_ | req.flags_) & certificate_flags);
+
+			std::string range;
+			if(req.method_ != L"GET" || req.header("Range", range)) {
+				response_t resp = dispatch(req);
+				// A successful unsafe method invalidates what we hold for its target (RFC 9111 section 4.4), under any options
+				if(req.method_ != L"GET" && req.method_ != L"HEAD" && resp.status() >= 200 && resp.status() < 400) {
+					for(unsigned int flags = 0; flags <= certificate_flags; ++flags) {
+						if((flags & ~certificate_flags) == 0) {
+							cache_->erase(target(req) + " " + std::to_string(flags));
+						}
+					}
+				}
+				return resp;
+			}
+
+			std::string request_cache_control, pragma;
+			req.header("Cache-Control", request_cache_control);
+			if(cache_directive(request_cache_control, "no-store", nullptr)) {
+				return dispatch(req);
+			}
+			bool revalidate = cache_directive(request_cache_control, "no-cache", nullptr) ||
+				(request_cache_control.empty() && req.header("Pragma", pragma) && cache_directive(pragma, "no-cache", nullptr));
+			long long max_age = -1;
+			cache_directive(request_cache_control, "max-age", &max_age);
+
+			std::shared_ptr<cache_t::entry_t> entry = cache_->lookup(key);
+			if(entry && entry->vary != vary_key(entry->headers, req)) {
+				entry.reset();
+			}
+			if(entry && !revalidate && !entry->no_cache) {
+				long long age = entry->current_age((long long)time(nullptr));
+				if(age < entry->freshness_lifetime && (max_age < 0 || age <= max_age)) {
+					return response_t(entry->status, entry->headers, entry->body, throws_);
+				}
+			}
+
+			// Stale or uncached; revalidate when we have something to validate against
+			std::string etag, last_modified;
+			bool conditional = entry && (find_header(entry->headers, "ETag", etag) | find_header(entry->headers, "Last-Modified", last_modified));
+			request_t revalidation(req);
+			if(!etag.empty()) {
+				revalidation.add_header("If-None-Match: " + etag);
+			}
+			if(!last_modified.empty()) {
+				revalidation.add_header("If-Modified-Since: " + last_modified);
+			}
+
+			response_t resp = dispatch(conditional ? revalidation : req);
+			if(!resp.ok() || resp.status() < 0) {
+				return resp;
+			}
+
+			std::string headers;
+			if(conditional && resp.status() == 304 && resp.raw_headers(headers)) {
+				std::shared_ptr<cache_t::entry_t> updated = std::make_shared<cache_t::entry_t>(*entry);
+				updated->headers = merge_headers(entry->headers, headers);
+				updated->response_time = (long long)time(nullptr);
+				updated->update_freshness();
+				cache_->store(updated);
+				return response_t(updated->status, updated->headers, updated->body, throws_);
+			}
+
+			static const int storable_statuses[] = { 200, 203, 204, 300, 301, 308, 404, 405, 410, 414, 501 };
+			bool storable = false;
+			for(size_t i = 0; i < sizeof(storable_statuses) / sizeof(storable_statuses[0]); ++i) {
+				storable = storable || resp.status() == storable_statuses[i];
+			}
+
+			std::string response_cache_control, vary;
+			resp.header("Cache-Control", response_cache_control);
+			if(!storable || cache_directive(response_cache_control, "no-store", nullptr) || (resp.header("Vary", vary) && trim(vary) == "*")) {
+				return resp;
+			}
+
+			// Decided from the headers alone, the body is only pulled into memory for something worth keeping
+			std::shared_ptr<cache_t::entry_t> stored = std::make_shared<cache_t::entry_t>();
+			if(!resp.raw_headers(stored->headers)) {
+				return resp;
+			}
+			stored->key = key;
+			stored->status = resp.status();
+			stored->vary = vary_key(stored->headers, req);
+			stored->response_time = (long long)time(nullptr);
+			stored->update_freshness();
+
+			// Nothing to gain from keeping a response we can neither reuse nor revalidate
+			if(stored->freshness_lifetime <= 0 && !find_header(stored->headers, "ETag", etag) && !find_header(stored->headers, "Last-Modified", last_modified)) {
+				return resp;
+			}
+			if(resp.buffer_body(cache_->shard_max_bytes_)) {
+				stored->body = resp.body_;
+				cache_->store(stored);
+			}
+			return resp;
+		}
+
+		unsigned int connection_t::prewarm(unsigned int count)
+		{
+			std::vector<std::string> addresses;
+			std::string host(components_.lpszHostName, components_.lpszHostName + components_.dwHostNameLength);
+			// Primes the system resolver cache, so the warming requests do not each wait on DNS
+			session_.resolve(host, addresses);
+
+			// Requests have to overlap, otherwise WinHTTP would keep handing back the same pooled socket. Each worker holds
+			// its responses open until it has sent its share, so a few threads are enough for any count.
+			unsigned int threads = count < max_prewarm_threads ? count : max_prewarm_threads;
+			std::vector<unsigned int> warmed(threads, 0);
+			std::vector<std::thread> workers;
+			for(unsigned int t = 0; t < threads; ++t) {
+				unsigned int share = count / threads + (t < count % threads ? 1 : 0);
+				unsigned int *result = &warmed[t];
+				workers.push_back(std::thread([this, share, result]() {
+#if _HAS_EXCEPTIONS
+					try {
+#endif
+						// Straight to the wire; a recording has no OPTIONS * to play, and a held response must not sit on a limiter slot
+						connection_t conn(session_, origin_);
+						conn.inherit_settings(*this);
+						conn.throws_ = false;
+						conn.replay_ = nullptr;
+						conn.limiter_ = nullptr;
+						conn.scheduler_ = nullptr;
+
+						std::vector<response_t> held;
+						for(unsigned int i = 0; i < share && conn.ok(); ++i) {
+							request_t req("OPTIONS", "*");
+							response_t resp = conn.transmit(req);
+							if(resp.ok() && resp.status() > 0) {
+								held.push_back(std::move(resp));
+							}
+						}
+
+						// Drain the bodies so the sockets go back to the session's pool
+						char buffer[4096];
+						for(auto iter = std::begin(held); iter != std::end(held); ++iter) {
+							size_t bytes_read = 0;
+							while(iter->read(buffer, sizeof(buffer), &bytes_read) && bytes_read > 0) {}
+							*result += iter->ok() ? 1 : 0;
+						}
+#if _HAS_EXCEPTIONS
+					} catch(const std::exception &) {
+					}
+#endif
+				}));
+			}
+
+			unsigned int opened = 0;
+			for(unsigned int t = 0; t < threads; ++t) {
+				workers[t].join();
+				opened += warmed[t];
+			}
+			return opened;
+		}
+
+		bool connection_t::download(const std::string &url, const std::string &path, unsigned int segments, bool resumable)
+		{
+			// Probe with a one byte range; a 206 tells us both the total size and that ranges are honoured
+			request_t probe("GET", url);
+			probe.add_header("Range: bytes=0-0");
+			response_t resp = send(probe);
+			if(!resp.ok()) {
+				THROW_ERROR(resp.error());
+				return false;
+			}
+			if(resp.status() < 0) {
+				// The exchange itself failed; send() has already reported why
+				return false;
+			}
+
+			download_state_t state;
+			state.checkpoint_path = path + ".checkpoint";
+			std::string content_range;
+			if(resp.status() == 206) {
+				if(!resp.header("Content-Range", content_range) || !parse_content_range_total(content_range, state.total)) {
+					THROW_ERROR("download() probe response has no usable Content-Range header");
+					return false;
+				}
+			} else if(resp.status() == 416) {
+				// Only an empty object can't satisfy bytes=0-0
+				state.total = 0;
+			} else if(resp.status() != 200) {
+				THROW_ERROR("download() probe failed with HTTP status " + std::to_string(resp.status()));
+				return false;
+			}
+
+			// If-Range needs a strong validator; fall back to Last-Modified, or give up on resuming
+			resp.header("ETag", state.etag);
+			resp.header("Last-Modified", state.last_modified);
+			if(!state.etag.empty() && state.etag.compare(0, 2, "W/") != 0) {
+				state.validator = state.etag;
+			} else {
+				state.validator = state.last_modified;
+			}
+			state.resumable = resumable && resp.status() == 206 && !state.validator.empty();
+
+			bool resuming = false;
+			if(state.resumable) {
+				download_state_t saved;
+				if(load_checkpoint(state.checkpoint_path, saved) && saved.total == state.total && saved.etag == state.etag && saved.last_modified == state.last_modified) {
+					state.completed = saved.completed;
+					resuming = true;
+				}
+			} else if(resumable) {
+				DeleteFileA(state.checkpoint_path.c_str());
+			}
+
+			std::string failure;
+			{
+				scoped_file_t file(CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, resuming ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+				if(!file.valid()) {
+					THROW_LAST_ERROR("CreateFile() failed");
+					return false;
+				}
+				state.file = file;
+
+				std::vector<char> buffer(download_chunk_size);
+				if(resp.status() == 200) {
+					// The server ignored the range, so the probe is already streaming the whole body
+					unsigned long long offset = 0;
+					size_t bytes_read = 0;
+					while(failure.empty() && resp.read(buffer.data(), buffer.size(), &bytes_read) && bytes_read > 0) {
+						if(!write_file_at(file, offset, buffer.data(), bytes_read)) {
+							failure = format_last_error("WriteFile() failed");
+						}
+						offset += bytes_read;
+					}
+					if(!resp.ok()) {
+						failure = resp.error();
+					}
+				} else if(state.total > 0) {
+					LARGE_INTEGER size;
+					if(resuming && (!GetFileSizeEx(file, &size) || (unsigned long long)size.QuadPart != state.total)) {
+						// The partial file doesn't match its checkpoint, so none of it can be trusted
+						state.completed.clear();
+					}
+					size.QuadPart = (LONGLONG)state.total;
+					if(!SetFilePointerEx(file, size, nullptr, FILE_BEGIN) || !SetEndOfFile(file)) {
+						failure = format_last_error("download() could not preallocate file");
+					}
+
+					size_t bytes_read = 0;
+					if(failure.empty() && (!resp.read(buffer.data(), buffer.size(), &bytes_read) || bytes_read != 1)) {
+						failure = resp.ok() ? "download() probe response body was not one byte" : resp.error();
+					}
+					if(failure.empty() && !write_file_at(file, 0, buffer.data(), 1)) {
+						failure = format_last_error("WriteFile() failed");
+					}
+					if(failure.empty()) {
+						state.mark_completed(0, 0, 1);
+					}
+
+					std::vector<download_range_t> missing;
+					unsigned long long missing_bytes = 0;
+					unsigned long long next = 0;
+					for(auto iter = std::begin(state.completed); iter != std::end(state.completed); ++iter) {
+						if(iter->first > next) {
+							missing.push_back(download_range_t(next, iter->first - 1));
+							missing_bytes += iter->first - next;
+						}
+						next = iter->last + 1;
+					}
+					if(next < state.total) {
+						missing.push_back(download_range_t(next, state.total - 1));
+						missing_bytes += state.total - next;
+					}
+
+					// Cut what's left into roughly one piece per segment, but never below the minimum segment size
+					unsigned long long piece_size = segments > 0 ? missing_bytes / segments : missing_bytes;
+					if(piece_size < download_min_segment_size) {
+						piece_size = download_min_segment_size;
+					}
+					for(auto iter = missing.rbegin(); iter != missing.rend(); ++iter) {
+						unsigned long long count = (iter->last - iter->first + piece_size) / piece_size;
+						for(unsigned long long i = count; i > 0; --i) {
+							unsigned long long first = iter->first + (i - 1) * piece_size;
+							unsigned long long last = (i == count) ? iter->last : first + piece_size - 1;
+							state.pending.push_back(download_range_t(first, last));
+						}
+					}
+
+					size_t worker_count = state.pending.size() < segments ? state.pending.size() : segments;
+					std::vector<std::thread> workers;
+					for(size_t i = 0; failure.empty() && i < worker_count; ++i) {
+						workers.push_back(std::thread([this, &url, &state]() {
+#if _HAS_EXCEPTIONS
+							try {
+								download_worker(url, state);
+							} catch(const std::exception &e) {
+								state.fail(e.what());
+							}
+#else
+							download_worker(url, state);
+#endif
+						}));
+					}
+
+					for(auto iter = std::begin(workers); iter != std::end(workers); ++iter) {
+						iter->join();
+					}
+
+					if(failure.empty()) {
+						failure = state.failure;
+					}
+				}
+
+				if(!FlushFileBuffers(file) && failure.empty()) {
+					failure = format_last_error("FlushFileBuffers() failed");
+				}
+				if(state.resumable && !failure.empty()) {
+					save_checkpoint(state);
+				}
+			}
+
+			if(!failure.empty()) {
+				if(!state.resumable) {
+					DeleteFileA(path.c_str());
+				}
+				THROW_ERROR(failure);
+				return false;
+			}
+
+			if(state.resumable) {
+				DeleteFileA(state.checkpoint_path.c_str());
+			}
+			return true;
+		}
+
+		void connection_t::download_worker(const std::string &url, download_state_t &state) const
+		{
+			while(true) {
+				download_range_t range(0, 0);
+				{
+					std::lock_guard<std::mutex> lock(state.mutex);
+					if(state.pending.empty() || !state.failure.empty()) {
+						return;
+					}
+					range = state.pending.back();
+					state.pending.pop_back();
+				}
+
+				std::string error;
+				if(!download_range(url, state, range.first, range.last, error)) {
+					state.fail(error);
+					return;
+				}
+			}
+		}
+
+		bool connection_t::download_range(const std::string &url, download_state_t &state, unsigned long long first, unsigned long long last, std::string &error) const
+		{
+			// Each segment gets its own connect handle; the session's socket pool supplies the sockets
+			connection_t conn(session_, origin_);
+			conn.inherit_settings(*this);
+			if(!conn.ok()) {
+				error = conn.error();
+				return false;
+			}
+
+			request_t req("GET", url);
+			req.add_header("Range: bytes=" + std::to_string(first) + "-" + std::to_string(last));
+			if(state.resumable) {
+				req.add_header("If-Range: " + state.validator);
+			}
+			response_t resp = conn.send(req);
+			if(!conn.ok()) {
+				error = conn.error();
+				return false;
+			}
+			if(!resp.ok()) {
+				error = resp.error();
+				return false;
+			}
+			if(resp.status() == 200 && state.resumable) {
+				// If-Range didn't match, so the object changed under us and the checkpoint is worthless
+				std::lock_guard<std::mutex> lock(state.mutex);
+				state.resumable = false;
+				DeleteFileA(state.checkpoint_path.c_str());
+				error = "download() object changed on the server while downloading";
+				return false;
+			}
+			if(resp.status() != 206) {
+				error = "download() range request failed with HTTP status " + std::to_string(resp.status());
+				return false;
+			}
+
+			std::vector<char> buffer(download_chunk_size);
+			unsigned long long offset = first;
+			while(offset <= last) {
+				size_t bytes_read = 0;
+				if(!resp.read(buffer.data(), buffer.size(), &bytes_read)) {
+					error = resp.error();
+					return false;
+				}
+				if(bytes_read == 0) {
+					break;
+				}
+				if(offset + bytes_read > last + 1) {
+					error = "download() range response was longer than requested";
+					return false;
+				}
+				if(!write_file_at(state.file, offset, buffer.data(), bytes_read)) {
+					error = format_last_error("WriteFile() failed");
+					return false;
+				}
+				state.mark_completed(offset, offset + bytes_read - 1, bytes_read);
+				offset += bytes_read;
+			}
+
+			if(offset != last + 1) {
+				error = "download() range response ended early";
+				return false;
+			}
+			return true;
+		}
+
+
+
+
+
+
+
+		request_t::request_t(const std::string &method, const std::string &url, memory_resource_t *resource)
+			: method_(std::begin(method), std::end(method), allocator_t<wchar_t>(resource)),
+			url_(std::begin(url), std::end(url), allocator_t<wchar_t>(resource)),
+			body_(allocator_t<char>(resource)),
+			additional_headers_(allocator_t<wide_string_t>(resource)),
+			flags_(0),
+			deadline_(0),
+			priority_(priority_normal),
+			digest_(digest_none)
+		{
+		}
+
+		request_t::request_t(const request_t &other)
+			: method_(other.method_),
+			url_(other.url_),
+			body_(other.body_),
+			additional_headers_(other.additional_headers_),
+			flags_(other.flags_),
+			deadline_(other.deadline_),
+			priority_(other.priority_),
+			digest_(other.digest_)
+		{
+		}
+
+		request_t::request_t(request_t &&other)
+			: method_(std::move(other.method_)),
+			url_(std::move(other.url_)),
+			body_(std::move(other.body_)),
+			additional_headers_(std::move(other.additional_headers_)),
+			flags_(other.flags_),
+			deadline_(other.deadline_),
+			priority_(other.priority_),
+			digest_(other.digest_)
+		{
+		}
+
+		request_t::~request_t()
+		{
+		}
+
+		request_t &request_t::operator=(const request_t &other)
+		{
+			method_ = other.method_;
+			url_ = other.url_;
+			body_ = other.body_;
+			additional_headers_ = other.additional_headers_;
+			flags_ = other.flags_;
+			deadline_ = other.deadline_;
+			priority_ = other.priority_;
+			digest_ = other.digest_;
+			return *this;
+		}
+
+		request_t &request_t::operator=(request_t &&other)
+		{
+			method_ = std::move(other.method_);
+			url_ = std::move(other.url_);
+			body_ = std::move(other.body_);
+			additional_headers_ = std::move(other.additional_headers_);
+			flags_ = other.flags_;
+			deadline_ = other.deadline_;
+			priority_ = other.priority_;
+			digest_ = other.digest_;
+			return *this;
+		}
+
+		void request_t::reset(const std::string &method, const std::string &url)
+		{
+			// assign/clear keep the existing capacity, which is the point of recycling
+			method_.assign(std::begin(method), std::end(method));
+			url_.assign(std::begin(url), std::end(url));
+			body_.clear();
+			additional_headers_.clear();
+			flags_ = 0;
+			deadline_ = 0;
+			priority_ = priority_normal;
+			digest_ = digest_none;
+		}
+
+		void request_t::add_header(const std::string &line)
+		{
+			additional_headers_.push_back(wide_string_t(std::begin(line), std::end(line), additional_headers_.get_allocator()));
+		}
+
+		void request_t::set_timeout(unsigned int milliseconds)
+		{
+			deadline_ = GetTickCount64() + milliseconds;
+		}
+
+		bool request_t::header(const std::string &name, std::string &value) const
+		{
+			auto headers_end = std::end(additional_headers_);
+			for(auto iter = std::begin(additional_headers_); iter != headers_end; ++iter) {
+				std::string line(std::begin(*iter), std::end(*iter));
+				if(match_header_line(line, name, value)) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		void request_t::set_option(option_t opt, bool on)
+		{
+			if(on) {
+				flags_ |= (1u << opt);
+			}
+			else {
+				flags_ &= ~(1u << opt);
+			}
+		}
+
+
+
+
+		response_t::response_t(HINTERNET request_t, cancel_t *cancel, unsigned long long deadline, DWORD timeout)
+			: handle_manage_t(request_t),
+			error_handler_t(false),
+			status_(-1),
+			buffer_(nullptr),
+			buffer_size_(0),
+			body_offset_(0),
+			deadline_(deadline),
+			timeout_(timeout),
+			pool_(nullptr),
+			resource_(nullptr)
+		{
+			if(handle_ != nullptr) {
+#ifdef WH_USE_WININET
+				if(cancel != nullptr && !cancel->detach()) {
+					handle_ = nullptr;
+					THROW_ERROR("request cancelled");
+					return;
+				}
+
+				pipeline_t::status(request_t, status_, *this);
+#else
+				BOOL received = WinHttpReceiveResponse(request_t, nullptr);
+				if(cancel != nullptr && !cancel->detach()) {
+					// cancel() already closed the handle, it must not be closed again
+					handle_ = nullptr;
+					THROW_ERROR("request cancelled");
+					return;
+				}
+				if(!received) {
+					THROW_LAST_ERROR("WinHttpReceiveResponse() failed");
+					return;
+				}
+
+				pipeline_t::status(request_t, status_, *this);
+#endif
+			}
+		}
+
+		response_t::response_t(int status, const std::string &headers, const std::shared_ptr<const std::string> &body, bool throws)
+			: error_handler_t(throws),
+			status_(status),
+			buffer_(nullptr),
+			buffer_size_(0),
+			headers_(headers),
+			body_(body),
+			body_offset_(0),
+			deadline_(0),
+			timeout_(0),
+			pool_(nullptr),
+			resource_(nullptr)
+		{
+		}
+
+		response_t::response_t()
+			: error_handler_t(false),
+			status_(-1),
+			buffer_(nullptr),
+			buffer_size_(0),
+			body_offset_(0),
+			deadline_(0),
+			timeout_(0),
+			pool_(nullptr),
+			resource_(nullptr)
+		{
+		}
+
+		response_t::response_t(response_t &&other)
+			: handle_manage_t(other.handle_),
+			error_handler_t(other),
+			status_(other.status_),
+			buffer_(other.buffer_),
+			buffer_size_(other.buffer_size_),
+			headers_(std::move(other.headers_)),
+			body_(std::move(other.body_)),
+			body_offset_(other.body_offset_),
+			deadline_(other.deadline_),
+			timeout_(other.timeout_),
+			pool_(other.pool_),
+			resource_(other.resource_),
+			digest_(std::move(other.digest_)),
+			digest_value_(std::move(other.digest_value_)),
+			digest_raw_(std::move(other.digest_raw_)),
+			scheduled_(std::move(other.scheduled_)),
+			limited_(std::move(other.limited_))
+		{
+			other.handle_ = nullptr;
+			other.buffer_ = nullptr;
+		}
+
+		response_t::~response_t()
+		{
+			end_exchange();
+			release_buffer();
+		}
+
+		response_t &response_t::operator=(response_t &&other)
+		{
+			if(this != &other) {
+				if(handle_ != nullptr) WH_INTERNET(CloseHandle)(handle_);
+				end_exchange();
+				release_buffer();
+				handle_ = other.handle_;
+				take_error(other);
+				throws_ = other.throws_;
+				status_ = other.status_;
+				buffer_ = other.buffer_;
+				buffer_size_ = other.buffer_size_;
+				headers_ = std::move(other.headers_);
+				body_ = std::move(other.body_);
+				body_offset_ = other.body_offset_;
+				deadline_ = other.deadline_;
+				timeout_ = other.timeout_;
+				pool_ = other.pool_;
+				resource_ = other.resource_;
+				digest_ = std::move(other.digest_);
+				digest_value_ = std::move(other.digest_value_);
+				digest_raw_ = std::move(other.digest_raw_);
+				scheduled_ = std::move(other.scheduled_);
+				limited_ = std::move(other.limited_);
+				other.handle_ = nullptr;
+				other.buffer_ = nullptr;
+			}
+			return *this;
+		}
+
+		void response_t::reset()
+		{
+			// Drops the request handle and body but keeps the read buffer for the next read
+			if(handle_ != nullptr) {
+				WH_INTERNET(CloseHandle)(handle_);
+				handle_ = nullptr;
+			}
+			end_exchange();
+			clear_error();
+			status_ = -1;
+			headers_.clear();
+			body_.reset();
+			body_offset_ = 0;
+			deadline_ = 0;
+			timeout_ = 0;
+			digest_.reset();
+			digest_value_.clear();
+			digest_raw_.clear();
+		}
+
+		const std::string &response_t::digest()
+		{
+			if(digest_) {
+				digest_raw_ = digest_->finish();
+				digest_value_ = encode_hex(digest_raw_);
+				digest_.reset();
+			}
+			return digest_value_;
+		}
+
+		bool response_t::verify_digest()
+		{
+			digest();
+			if(digest_raw_.empty()) {
+				return false;
+			}
+
+			std::string expected;
+			std::string encoded = encode_base64(digest_raw_);
+			if(digest_raw_.length() == 16 && header("Content-MD5", expected)) {
+				return trim(expected) == encoded;
+			}
+			if(digest_raw_.length() == 32) {
+				// Repr-Digest: sha-256=:...: (RFC 9530), or the older Digest: SHA-256=... (RFC 3230)
+				if(header("Repr-Digest", expected) || header("Content-Digest", expected)) {
+					return expected.find(":" + encoded + ":") != std::string::npos;
+				}
+				if(header("Digest", expected)) {
+					return expected.find("=" + encoded) != std::string::npos;
+				}
+			}
+			if(digest_raw_.length() == 4 && header("x-goog-hash", expected)) {
+				return expected.find("crc32c=" + encoded) != std::string::npos;
+			}
+			if(header("ETag", expected)) {
+				// Object stores commonly use the hex MD5 of the body as a strong ETag
+				expected = trim(expected);
+				if(expected.length() > 2 && expected.front() == '"' && expected.back() == '"') {
+					expected = expected.substr(1, expected.length() - 2);
+				}
+				std::transform(expected.begin(), expected.end(), expected.begin(), ::tolower);
+				return expected == digest_value_;
+			}
+			return false;
+		}
+
+		void response_t::end_exchange()
+		{
+			// The limiter slot measures the whole exchange, so it goes first; then the scheduler lets the next one in
+			limited_.reset();
+			scheduled_.reset();
+		}
+
+		void response_t::release_buffer()
+		{
+			if(buffer_ == nullptr) {
+				return;
+			}
+			if(resource_ != nullptr) {
+				resource_->deallocate(buffer_, buffer_size_, 16);
+			}
+			else {
+				delete[] buffer_;
+			}
+			buffer_ = nullptr;
+		}
+
+		bool response_t::http2() const
+		{
+			return pipeline_t::http2(handle_);
+		}
+
+		bool response_t::header(const std::string &name, std::string &value) const
+		{
+			if(!headers_.empty()) {
+				return find_header(headers_, name, value);
+			}
+			if(handle_ == nullptr) {
+				return false;
+			}
+
+#ifdef WH_USE_WININET
+			std::vector<char> buffer(name.begin(), name.end());
+			buffer.resize(buffer.size() < 256 ? 256 : buffer.size() + 1, 0);
+			DWORD size = (DWORD)buffer.size();
+			if(!HttpQueryInfoA(handle_, HTTP_QUERY_CUSTOM, buffer.data(), &size, nullptr)) {
+				if(GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+					return false;
+				}
+				std::vector<char> larger(size + 1, 0);
+				memcpy(larger.data(), name.c_str(), name.length());
+				buffer.swap(larger);
+				if(!HttpQueryInfoA(handle_, HTTP_QUERY_CUSTOM, buffer.data(), &size, nullptr)) {
+					return false;
+				}
+			}
+			value.assign(buffer.data(), size);
+#else
+			std::wstring wide_name(std::begin(name), std::end(name));
+			DWORD size = 0;
+			WinHttpQueryHeaders(handle_, WINHTTP_QUERY_CUSTOM, wide_name.c_str(), WINHTTP_NO_OUTPUT_BUFFER, &size, WINHTTP_NO_HEADER_INDEX);
+			if(GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+				return false;
+			}
+			std::vector<wchar_t> buffer(size / sizeof(wchar_t) + 1);
+			if(!WinHttpQueryHeaders(handle_, WINHTTP_QUERY_CUSTOM, wide_name.c_str(), buffer.data(), &size, WINHTTP_NO_HEADER_INDEX)) {
+				return false;
+			}
+			value.assign(buffer.data(), buffer.data() + size / sizeof(wchar_t));
+#endif
+			return true;
+		}
+
+		bool response_t::arm_receive_timeout()
+		{
+			if(deadline_ == 0) {
+				return true;
+			}
+
+			DWORD timeout = 0;
+			unsigned long long now = GetTickCount64();
+			if(now >= deadline_) {
+				return false;
+			}
+			timeout = deadline_ - now < timeout_ ? (DWORD)(deadline_ - now) : timeout_;
+			return WH_INTERNET(SetOption)(handle_, WH_INTERNET_CONST(OPTION_RECEIVE_TIMEOUT), (LPVOID)&timeout, sizeof(DWORD)) != FALSE;
+		}
+
+		bool response_t::raw_headers(std::string &out) const
+		{
+			if(!headers_.empty()) {
+				out = headers_;
+				return true;
+			}
+			if(handle_ == nullptr) {
+				return false;
+			}
+
+#ifdef WH_USE_WININET
+			DWORD size = 0;
+			HttpQueryInfoA(handle_, HTTP_QUERY_RAW_HEADERS_CRLF, nullptr, &size, nullptr);
+			if(GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+				return false;
+			}
+			std::vector<char> buffer(size + 1);
+			if(!HttpQueryInfoA(handle_, HTTP_QUERY_RAW_HEADERS_CRLF, buffer.data(), &size, nullptr)) {
+				return false;
+			}
+			out.assign(buffer.data(), size);
+#else
+			DWORD size = 0;
+			WinHttpQueryHeaders(handle_, WINHTTP_QUERY_RAW_HEADERS_CRLF, WINHTTP_HEADER_NAME_BY_INDEX, WINHTTP_NO_OUTPUT_BUFFER, &size, WINHTTP_NO_HEADER_INDEX);
+			if(GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+				return false;
+			}
+			std::vector<wchar_t> buffer(size / sizeof(wchar_t) + 1);
+			if(!WinHttpQueryHeaders(handle_, WINHTTP_QUERY_RAW_HEADERS_CRLF, WINHTTP_HEADER_NAME_BY_INDEX, buffer.data(), &size, WINHTTP_NO_HEADER_INDEX)) {
+				return false;
+			}
+			out.assign(buffer.data(), buffer.data() + size / sizeof(wchar_t));
+#endif
+			return true;
+		}
+
+		bool response_t::buffer_body(size_t limit)
+		{
+			// Pull up to limit bytes into memory; read() serves them before whatever is left on the wire
+			if(handle_ == nullptr || body_ || !raw_headers(headers_)) {
+				return false;
+			}
+
+			std::string content_length;
+			if(header("Content-Length", content_length) && strtoull(content_length.c_str(), nullptr, 10) > limit) {
+				return false;
+			}
+
+			std::shared_ptr<std::string> body = std::make_shared<std::string>();
+			char chunk[16 * 1024];
+			size_t bytes_read = 0;
+			bool complete = false;
+			while(body->length() < limit) {
+				size_t want = limit - body->length() < sizeof(chunk) ? limit - body->length() : sizeof(chunk);
+				if(!read(chunk, want, &bytes_read)) {
+					break;
+				}
+				if(bytes_read == 0) {
+					complete = true;
+					break;
+				}
+				body->append(chunk, bytes_read);
+			}
+			if(!complete && ok() && body->length() >= limit) {
+				// Exactly limit bytes long is still complete if nothing else is available
+				DWORD data_available = 0;
+				complete = WH_INTERNET(QueryDataAvailable)(handle_, &data_available WH_WININET_ARGS(0, 0) ) && data_available == 0;
+			}
+
+			body_ = body;
+			body_offset_ = 0;
+			if(complete) {
+				WH_INTERNET(CloseHandle)(handle_);
+				handle_ = nullptr;
+				end_exchange();
+			}
+			return complete;
+		}
+
+		bool response_t::read(std::ostream &out)
+		{
+			if(body_) {
+				out.write(body_->data() + body_offset_, body_->length() - body_offset_);
+				body_offset_ = body_->length();
+				if(handle_ == nullptr) {
+					return true;
+				}
+			}
+
+			if(handle_ == nullptr) {
+				return false;
+			}
+
+			if(buffer_ == nullptr) {
+				if(resource_ != nullptr) {
+					buffer_size_ = pool_ != nullptr ? pool_->read_chunk_size() : default_read_chunk_size;
+					buffer_ = static_cast<char *>(resource_->allocate(buffer_size_, 16));
+				}
+				else if(pool_ != nullptr) {
+					buffer_ = pool_->acquire_buffer(buffer_size_);
+				}
+				else {
+					buffer_size_ = default_read_chunk_size;
+					buffer_ = new char[buffer_size_];
+				}
+			}
+
+			while(true) {
+
+				if(!arm_receive_timeout()) {
+					THROW_ERROR("request_t deadline exceeded while reading the response");
+					end_exchange();
+					return false;
+				}
+
+				size_t bytes_read = 0;
+				if(!pipeline_t::read_fill(handle_, buffer_, buffer_size_, bytes_read, *this)) {
+					end_exchange();
+					return false;
+				}
+				if(bytes_read == 0) {
+					end_exchange();
+					break;
+				}
+
+				if(digest_) {
+					digest_->update(buffer_, bytes_read);
+				}
+				out.write(buffer_, bytes_read);
+			}
+			return true;
+		}
+
+		bool response_t::read(char *buffer, size_t count, size_t *bytes_read)
+		{
+			size_t remaining = count;
+			char *p = buffer;
+
+			if(body_) {
+				size_t buffered = body_->length() - body_offset_;
+				size_t copied = buffered < remaining ? buffered : remaining;
+				memcpy(p, body_->data() + body_offset_, copied);
+				body_offset_ += copied;
+				p += copied;
+				remaining -= copied;
+				if(handle_ == nullptr) {
+					if(bytes_read != nullptr) {
+						*bytes_read = count - remaining;
+					}
+					return true;
+				}
+			}
+
+			if(handle_ == nullptr) {
+				return false;
+			}
+
+			while(remaining > 0) {
+
+				if(!arm_receive_timeout()) {
+					THROW_ERROR("request_t deadline exceeded while reading the response");
+					end_exchange();
+					return false;
+				}
+
+				size_t copied = 0;
+				if(!pipeline_t::read_fill(handle_, p, remaining, copied, *this)) {
+					end_exchange();
+					return false;
+				}
+				if(copied == 0) {
+					end_exchange();
+					break;
+				}
+
+				if(digest_) {
+					digest_->update(p, copied);
+				}
+				p += copied;
+				remaining -= copied;
+			}
+
+			if(bytes_read != nullptr) {
+				*bytes_read = count - remaining;
+			}
+
+			return true;
+		}
+
+		bool response_t::read_some(char *buffer, size_t count, size_t *bytes_read)
+		{
+			if(body_ && body_offset_ < body_->length()) {
+				size_t buffered = body_->length() - body_offset_;
+				size_t copied = buffered < count ? buffered : count;
+				memcpy(buffer, body_->data() + body_offset_, copied);
+				body_offset_ += copied;
+				if(bytes_read != nullptr) {
+					*bytes_read = copied;
+				}
+				return true;
+			}
+
+			if(handle_ == nullptr) {
+				if(bytes_read != nullptr) {
+					*bytes_read = 0;
+				}
+				return (bool)body_;
+			}
+
+			if(!arm_receive_timeout()) {
+				THROW_ERROR("request_t deadline exceeded while reading the response");
+				end_exchange();
+				return false;
+			}
+
+			size_t copied = 0;
+			if(!pipeline_t::read_some(handle_, buffer, count, copied, *this)) {
+				end_exchange();
+				return false;
+			}
+			if(copied == 0) {
+				end_exchange();
+			}
+			if(digest_) {
+				digest_->update(buffer, copied);
+			}
+			if(bytes_read != nullptr) {
+				*bytes_read = copied;
+			}
+			return true;
+		}
+
+
+
+#ifndef WH_USE_WININET
+		websocket_t::websocket_t(HINTERNET socket, bool throws, const error_handler_t &origin)
+			: handle_manage_t(socket),
+			error_handler_t(throws),
+			close_status_(0)
+		{
+			// A failed upgrade carries the connection's error
+			if(handle_ == nullptr) {
+				take_error(origin);
+			}
+		}
+
+		websocket_t::websocket_t(websocket_t &&other)
+			: handle_manage_t(other.handle_),
+			error_handler_t(other),
+			close_status_(other.close_status_),
+			close_reason_(std::move(other.close_reason_))
+		{
+			other.handle_ = nullptr;
+		}
+
+		websocket_t::~websocket_t()
+		{
+		}
+
+		bool websocket_t::send(const char *data, size_t length, message_type_t type)
+		{
+			return send_fragment(data, length, type, true);
+		}
+
+		bool websocket_t::send_fragment(const char *data, size_t length, message_type_t type, bool final)
+		{
+			if(handle_ == nullptr) {
+				return false;
+			}
+			if(type == message_close) {
+				return close();
+			}
+
+			WINHTTP_WEB_SOCKET_BUFFER_TYPE buffer_type;
+			if(type == message_text) {
+				buffer_type = final ? WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE : WINHTTP_WEB_SOCKET_UTF8_FRAGMENT_BUFFER_TYPE;
+			}
+			else {
+				buffer_type = final ? WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE : WINHTTP_WEB_SOCKET_BINARY_FRAGMENT_BUFFER_TYPE;
+			}
+
+			// The websocket calls return their error instead of setting the last error
+			DWORD result = WinHttpWebSocketSend(handle_, buffer_type, (PVOID)data, (DWORD)length);
+			if(result != NO_ERROR) {
+				core_traits_t::fail(*this, "WinHttpWebSocketSend() failed", result);
+				return false;
+			}
+			return true;
+		}
+
+		bool websocket_t::receive(std::string &message, message_type_t &type)
+		{
+			static const size_t min_free = 16 * 1024;
+
+			message.clear();
+			if(handle_ == nullptr) {
+				return false;
+			}
+
+			// Fragments land directly behind each other in message, which is trimmed to size at the end
+			size_t used = 0;
+			while(true) {
+				if(message.size() - used < min_free) {
+					message.resize(used + (used > min_free ? used : min_free));
+				}
+
+				DWORD bytes_read = 0;
+				WINHTTP_WEB_SOCKET_BUFFER_TYPE buffer_type;
+				DWORD result = WinHttpWebSocketReceive(handle_, &message[used], (DWORD)(message.size() - used), &bytes_read, &buffer_type);
+				if(result != NO_ERROR) {
+					message.resize(used);
+					core_traits_t::fail(*this, "WinHttpWebSocketReceive() failed", result);
+					return false;
+				}
+				used += bytes_read;
+
+				switch(buffer_type) {
+				case WINHTTP_WEB_SOCKET_BINARY_FRAGMENT_BUFFER_TYPE:
+				case WINHTTP_WEB_SOCKET_UTF8_FRAGMENT_BUFFER_TYPE:
+					continue;
+				case WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE:
+					type = message_binary;
+					break;
+				case WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE:
+					type = message_text;
+					break;
+				default:
+					type = message_close;
+					query_close_status();
+					break;
+				}
+				message.resize(used);
+				return true;
+			}
+		}
+
+		bool websocket_t::close(unsigned short status, const std::string &reason)
+		{
+			if(handle_ == nullptr) {
+				return false;
+			}
+
+			DWORD result = WinHttpWebSocketClose(handle_, status, reason.empty() ? nullptr : (PVOID)reason.data(), (DWORD)reason.length());
+			if(result != NO_ERROR) {
+				core_traits_t::fail(*this, "WinHttpWebSocketClose() failed", result);
+				return false;
+			}
+			return query_close_status();
+		}
+
+		bool websocket_t::query_close_status()
+		{
+			char reason[WINHTTP_WEB_SOCKET_MAX_CLOSE_REASON_LENGTH];
+			DWORD reason_length = 0;
+			USHORT status = 0;
+			DWORD result = WinHttpWebSocketQueryCloseStatus(handle_, &status, reason, sizeof(reason), &reason_length);
+			if(result != NO_ERROR) {
+				return false;
+			}
+			close_status_ = status;
+			close_reason_.assign(reason, reason_length);
+			return true;
+		}
+#endif
+
+
+
+		digest_t::digest_t(digest_algorithm_t algorithm)
+			: algorithm_(algorithm),
+			crc_(0xffffffffu),
+			stripe_length_(0),
+			total_(0),
+			hash_(nullptr)
+		{
+			lanes_[0] = xxh_prime1 + xxh_prime2;
+			lanes_[1] = xxh_prime2;
+			lanes_[2] = 0;
+			lanes_[3] = 0 - xxh_prime1;
+
+			if(algorithm_ == digest_sha256 || algorithm_ == digest_md5) {
+				BCRYPT_ALG_HANDLE provider = digest_provider(algorithm_);
+				DWORD object_length = 0;
+				ULONG size = 0;
+				if(provider == nullptr ||
+					!BCRYPT_SUCCESS(BCryptGetProperty(provider, BCRYPT_OBJECT_LENGTH, (PUCHAR)&object_length, sizeof(object_length), &size, 0))) {
+					algorithm_ = digest_none;
+					return;
+				}
+				object_.resize(object_length);
+				BCRYPT_HASH_HANDLE hash = nullptr;
+				if(!BCRYPT_SUCCESS(BCryptCreateHash(provider, &hash, object_.data(), (ULONG)object_.size(), nullptr, 0, 0))) {
+					algorithm_ = digest_none;
+					return;
+				}
+				hash_ = hash;
+			}
+		}
+
+		digest_t::~digest_t()
+		{
+			if(hash_ != nullptr) {
+				BCryptDestroyHash((BCRYPT_HASH_HANDLE)hash_);
+			}
+		}
+
+		void digest_t::update(const void *data, size_t length)
+		{
+			const unsigned char *p = (const unsigned char *)data;
+			switch(algorithm_) {
+			case digest_crc32c:
+				crc_ = crc32c_update(crc_, p, length);
+				break;
+
+			case digest_xxhash64:
+				total_ += length;
+				if(stripe_length_ > 0) {
+					size_t take = 32 - stripe_length_ < length ? 32 - stripe_length_ : length;
+					memcpy(stripe_ + stripe_length_, p, take);
+					stripe_length_ += take;
+					p += take;
+					length -= take;
+					if(stripe_length_ < 32) {
+						break;
+					}
+					for(int lane = 0; lane < 4; ++lane) {
+						lanes_[lane] = xxh_round(lanes_[lane], read_u64(stripe_ + lane * 8));
+					}
+					stripe_length_ = 0;
+				}
+				for(; length >= 32; p += 32, length -= 32) {
+					for(int lane = 0; lane < 4; ++lane) {
+						lanes_[lane] = xxh_round(lanes_[lane], read_u64(p + lane * 8));
+					}
+				}
+				memcpy(stripe_, p, length);
+				stripe_length_ = length;
+				break;
+
+			case digest_sha256:
+			case digest_md5:
+				// BCrypt takes ULONG lengths
+				while(length > 0) {
+					ULONG chunk = length > 0x40000000 ? 0x40000000 : (ULONG)length;
+					BCryptHashData((BCRYPT_HASH_HANDLE)hash_, (PUCHAR)p, chunk, 0);
+					p += chunk;
+					length -= chunk;
+				}
+				break;
+
+			default:
+				break;
+			}
+		}
+
+		std::string digest_t::finish()
+		{
+			std::string raw;
+			switch(algorithm_) {
+			case digest_crc32c:
+			{
+				unsigned int crc = ~crc_;
+				for(int shift = 24; shift >= 0; shift -= 8) {
+					raw.push_back((char)(crc >> shift));
+				}
+				break;
+			}
+
+			case digest_xxhash64:
+			{
+				unsigned long long h;
+				if(total_ >= 32) {
+					h = xxh_rotl(lanes_[0], 1) + xxh_rotl(lanes_[1], 7) + xxh_rotl(lanes_[2], 12) + xxh_rotl(lanes_[3], 18);
+					for(int lane = 0; lane < 4; ++lane) {
+						h = xxh_merge(h, lanes_[lane]);
+					}
+				}
+				else {
+					h = xxh_prime5;
+				}
+				h += total_;
+
+				const unsigned char *p = stripe_;
+				size_t length = stripe_length_;
+				for(; length >= 8; p += 8, length -= 8) {
+					h ^= xxh_round(0, read_u64(p));
+					h = xxh_rotl(h, 27) * xxh_prime1 + xxh_prime4;
+				}
+				if(length >= 4) {
+					h ^= (unsigned long long)read_u32(p) * xxh_prime1;
+					h = xxh_rotl(h, 23) * xxh_prime2 + xxh_prime3;
+					p += 4;
+					length -= 4;
+				}
+				for(; length > 0; ++p, --length) {
+					h ^= *p * xxh_prime5;
+					h = xxh_rotl(h, 11) * xxh_prime1;
+				}
+				h ^= h >> 33;
+				h *= xxh_prime2;
+				h ^= h >> 29;
+				h *= xxh_prime3;
+				h ^= h >> 32;
+
+				for(int shift = 56; shift >= 0; shift -= 8) {
+					raw.push_back((char)(h >> shift));
+				}
+				break;
+			}
+
+			case digest_sha256:
+			case digest_md5:
+				raw.resize(algorithm_ == digest_sha256 ? 32 : 16);
+				if(!BCRYPT_SUCCESS(BCryptFinishHash((BCRYPT_HASH_HANDLE)hash_, (PUCHAR)&raw[0], (ULONG)raw.size(), 0))) {
+					raw.clear();
+				}
+				break;
+
+			default:
+				break;
+			}
+			return raw;
+		}
+
+
+
+		stream_reader_t::stream_reader_t(response_t &resp, size_t capacity)
+			: resp_(resp),
+			buffer_(capacity > 0 ? capacity : 1),
+			begin_(0),
+			end_(0),
+			scanned_(0),
+			eof_(false),
+			started_(false)
+		{
+		}
+
+		bool stream_reader_t::fill()
+		{
+			if(eof_) {
+				return false;
+			}
+
+			// Slide the unconsumed tail to the front before growing, so steady state never allocates
+			if(begin_ > 0) {
+				memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+				end_ -= begin_;
+				scanned_ -= begin_;
+				begin_ = 0;
+			}
+			if(end_ == buffer_.size()) {
+				buffer_.resize(buffer_.size() * 2);
+			}
+
+			size_t bytes_read = 0;
+			if(!resp_.read_some(buffer_.data() + end_, buffer_.size() - end_, &bytes_read) || bytes_read == 0) {
+				eof_ = true;
+				return false;
+			}
+			end_ += bytes_read;
+			return true;
+		}
+
+		bool stream_reader_t::line(const char *&begin, const char *&end)
+		{
+			while(true) {
+				const char *base = buffer_.data();
+				const char *found = core::find_line_end(base + scanned_, base + end_);
+				size_t offset = found - base;
+
+				// A CR as the last byte may still be the first half of a CRLF
+				bool pending_cr = offset + 1 == end_ && *found == '\r' && !eof_;
+				if(offset < end_ && !pending_cr) {
+					begin = base + begin_;
+					end = found;
+					begin_ = offset + 1;
+					if(*found == '\r' && begin_ < end_ && base[begin_] == '\n') {
+						++begin_;
+					}
+					scanned_ = begin_;
+					return true;
+				}
+
+				scanned_ = offset;
+				if(!fill()) {
+					// The last line may be unterminated
+					if(begin_ < end_) {
+						begin = buffer_.data() + begin_;
+						end = buffer_.data() + end_;
+						if(end[-1] == '\r') {
+							--end;
+						}
+						begin_ = scanned_ = end_;
+						return true;
+					}
+					return false;
+				}
+			}
+		}
+
+		bool stream_reader_t::next_line(std::string &out)
+		{
+			const char *begin, *end;
+			do {
+				if(!line(begin, end)) {
+					return false;
+				}
+			} while(begin == end);
+			out.assign(begin, end);
+			return true;
+		}
+
+		bool stream_reader_t::next_event(event_t &event)
+		{
+			event.type.clear();
+			event.data.clear();
+			event.retry = 0;
+
+			const char *begin, *end;
+			while(line(begin, end)) {
+				if(!started_) {
+					started_ = true;
+					if(end - begin >= 3 && memcmp(begin, "\xEF\xBB\xBF", 3) == 0) {
+						begin += 3;
+					}
+				}
+
+				if(begin == end) {
+					if(event.data.empty()) {
+						event.type.clear();
+						continue;
+					}
+					event.data.pop_back();
+					if(event.type.empty()) {
+						event.type = "message";
+					}
+					event.id = last_event_id_;
+					return true;
+				}
+				if(*begin == ':') {
+					continue;
+				}
+
+				const char *colon = (const char *)memchr(begin, ':', end - begin);
+				const char *value = end;
+				if(colon != nullptr) {
+					value = colon + 1;
+					if(value < end && *value == ' ') {
+						++value;
+					}
+				}
+				else {
+					colon = end;
+				}
+
+				size_t name_length = colon - begin;
+				if(name_length == 5 && memcmp(begin, "event", 5) == 0) {
+					event.type.assign(value, end);
+				}
+				else if(name_length == 4 && memcmp(begin, "data", 4) == 0) {
+					event.data.append(value, end);
+					event.data.push_back('\n');
+				}
+				else if(name_length == 2 && memcmp(begin, "id", 2) == 0) {
+					if(memchr(value, 0, end - value) == nullptr) {
+						last_event_id_.assign(value, end);
+					}
+				}
+				else if(name_length == 5 && memcmp(begin, "retry", 5) == 0) {
+					if(value < end && std::all_of(value, end, [](char c) { return c >= '0' && c <= '9'; })) {
+						event.retry = (unsigned int)strtoul(std::string(value, end).c_str(), nullptr, 10);
+					}
+				}
+			}
+			// Incomplete events at the end of the stream are discarded
+			return false;
+		}
+
+
+
+
+
+		cache_t::cache_t(size_t max_bytes, const std::string &directory, unsigned int shards)
+			: shard_max_bytes_(max_bytes / (shards > 0 ? shards : 1)),
+			directory_(directory)
+		{
+			for(unsigned int i = 0; i < (shards > 0 ? shards : 1); ++i) {
+				shards_.push_back(std::unique_ptr<shard_t>(new shard_t()));
+			}
+			if(!directory_.empty()) {
+				CreateDirectoryA(directory_.c_str(), nullptr);
+			}
+		}
+
+		cache_t::~cache_t()
+		{
+		}
+
+		void cache_t::clear()
+		{
+			for(auto iter = std::begin(shards_); iter != std::end(shards_); ++iter) {
+				std::lock_guard<std::mutex> lock((*iter)->mutex);
+				(*iter)->lru.clear();
+				(*iter)->index.clear();
+				(*iter)->bytes = 0;
+			}
+
+			if(!directory_.empty()) {
+				WIN32_FIND_DATAA found;
+				HANDLE find = FindFirstFileA((directory_ + "\\*.cache").c_str(), &found);
+				if(find != INVALID_HANDLE_VALUE) {
+					do {
+						DeleteFileA((directory_ + "\\" + found.cFileName).c_str());
+					} while(FindNextFileA(find, &found));
+					FindClose(find);
+				}
+			}
+		}
+
+		size_t cache_t::size() const
+		{
+			size_t total = 0;
+			for(auto iter = std::begin(shards_); iter != std::end(shards_); ++iter) {
+				std::lock_guard<std::mutex> lock((*iter)->mutex);
+				total += (*iter)->bytes;
+			}
+			return total;
+		}
+
+		cache_t::shard_t &cache_t::shard_for(const std::string &key) const
+		{
+			return *shards_[std::hash<std::string>()(key) % shards_.size()];
+		}
+
+		std::shared_ptr<cache_t::entry_t> cache_t::lookup(const std::string &key)
+		{
+			shard_t &shard = shard_for(key);
+			{
+				std::lock_guard<std::mutex> lock(shard.mutex);
+				auto found = shard.index.find(key);
+				if(found != shard.index.end()) {
+					shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+					return *found->second;
+				}
+			}
+
+			if(directory_.empty()) {
+				return std::shared_ptr<entry_t>();
+			}
+
+			std::shared_ptr<entry_t> entry = load(key);
+			if(entry) {
+				store(entry, false);
+			}
+			return entry;
+		}
+
+		void cache_t::store(const std::shared_ptr<entry_t> &entry, bool persist)
+		{
+			shard_t &shard = shard_for(entry->key);
+			std::vector<std::string> evicted;
+			bool kept = false;
+			{
+				std::lock_guard<std::mutex> lock(shard.mutex);
+				auto found = shard.index.find(entry->key);
+				if(found != shard.index.end()) {
+					shard.bytes -= (*found->second)->size();
+					shard.lru.erase(found->second);
+					shard.index.erase(found);
+				}
+
+				if(entry->size() <= shard_max_bytes_) {
+					kept = true;
+					shard.lru.push_front(entry);
+					shard.index[entry->key] = shard.lru.begin();
+					shard.bytes += entry->size();
+					while(shard.bytes > shard_max_bytes_) {
+						shard.bytes -= shard.lru.back()->size();
+						shard.index.erase(shard.lru.back()->key);
+						evicted.push_back(shard.lru.back()->key);
+						shard.lru.pop_back();
+					}
+				}
+			}
+
+			// The directory mirrors what is held in memory, so it stays within the same byte budget
+			if(!directory_.empty()) {
+				for(auto iter = std::begin(evicted); iter != std::end(evicted); ++iter) {
+					DeleteFileA(disk_path(*iter).c_str());
+				}
+				if(!kept) {
+					DeleteFileA(disk_path(entry->key).c_str());
+				}
+				else if(persist) {
+					save(*entry);
+				}
+			}
+		}
+
+		void cache_t::erase(const std::string &key)
+		{
+			shard_t &shard = shard_for(key);
+			{
+				std::lock_guard<std::mutex> lock(shard.mutex);
+				auto found = shard.index.find(key);
+				if(found != shard.index.end()) {
+					shard.bytes -= (*found->second)->size();
+					shard.lru.erase(found->second);
+					shard.index.erase(found);
+				}
+			}
+
+			if(!directory_.empty()) {
+				DeleteFileA(disk_path(key).c_str());
+			}
+		}
+
+		std::string cache_t::disk_path(const std::string &key) const
+		{
+			// FNV-1a keeps file names short; the key stored inside the file settles collisions
+			unsigned long long hash = 14695981039346656037ull;
+			for(auto iter = std::begin(key); iter != std::end(key); ++iter) {
+				hash = (hash ^ (unsigned char)*iter) * 1099511628211ull;
+			}
+			char name[17];
+			for(int i = 15; i >= 0; --i) {
+				name[i] = "0123456789abcdef"[hash & 0xf];
+				hash >>= 4;
+			}
+			name[16] = 0;
+			return directory_ + "\\" + name + ".cache";
+		}
+
+		std::shared_ptr<cache_t::entry_t> cache_t::load(const std::string &key) const
+		{
+			std::ifstream in(disk_path(key).c_str(), std::ios::in | std::ios::binary);
+			std::string magic;
+			std::shared_ptr<entry_t> entry = std::make_shared<entry_t>();
+			size_t key_length = 0, vary_length = 0, headers_length = 0, body_length = 0;
+			if(!std::getline(in, magic) || magic != "winhttp-cache 1" ||
+				!(in >> entry->status >> entry->response_time >> key_length >> vary_length >> headers_length >> body_length) || in.get() != '\n') {
+				return std::shared_ptr<entry_t>();
+			}
+
+			std::string stored_key(key_length, 0);
+			entry->vary.resize(vary_length);
+			entry->headers.resize(headers_length);
+			std::shared_ptr<std::string> body = std::make_shared<std::string>(body_length, 0);
+			if(key_length > 0) in.read(&stored_key[0], key_length);
+			if(vary_length > 0) in.read(&entry->vary[0], vary_length);
+			if(headers_length > 0) in.read(&entry->headers[0], headers_length);
+			if(body_length > 0) in.read(&(*body)[0], body_length);
+			if(!in || stored_key != key) {
+				return std::shared_ptr<entry_t>();
+			}
+
+			entry->key = key;
+			entry->body = body;
+			entry->update_freshness();
+			return entry;
+		}
+
+		void cache_t::save(const entry_t &entry) const
+		{
+			std::string path = disk_path(entry.key);
+			std::string temp_path = path + ".tmp";
+			{
+				std::ofstream out(temp_path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+				out << "winhttp-cache 1\n" << entry.status << " " << entry.response_time << " " << entry.key.length() << " " <<
+					entry.vary.length() << " " << entry.headers.length() << " " << (entry.body ? entry.body->length() : 0) << "\n";
+				out << entry.key << entry.vary << entry.headers;
+				if(entry.body) {
+					out.write(entry.body->data(), entry.body->length());
+				}
+				if(!out) {
+					return;
+				}
+			}
+			MoveFileExA(temp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+		}
+
+
+
+		// Log layout: the magic line, then per exchange a replay_record_t followed by the key, the raw headers and the
+		// body. Nothing is aligned or compressed, so the index points straight into the mapped file; a played back body is
+		// still copied out of it once, since the response may outlive the replay_t.
+		static const char replay_magic[] = "winhttp-replay 1\n";
+
+		struct replay_record_t
+		{
+			unsigned int key_length;
+			int status;
+			unsigned int elapsed;
+			unsigned int headers_length;
+			unsigned long long body_length;
+		};
+
+		replay_t::replay_t(const std::string &path, mode_t mode)
+			: mode_(mode),
+			timed_(false),
+			file_(INVALID_HANDLE_VALUE),
+			mapping_(nullptr),
+			view_(nullptr),
+			entries_(0)
+		{
+			if(mode_ == mode_record) {
+				file_ = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+				DWORD written = 0;
+				if(file_ == INVALID_HANDLE_VALUE || !WriteFile(file_, replay_magic, sizeof(replay_magic) - 1, &written, nullptr)) {
+					THROW_LAST_ERROR("Creating the replay_t log failed");
+				}
+				return;
+			}
+
+			file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			LARGE_INTEGER size;
+			if(file_ == INVALID_HANDLE_VALUE || !GetFileSizeEx(file_, &size)) {
+				THROW_LAST_ERROR("Opening the replay_t log failed");
+				return;
+			}
+			if((unsigned long long)size.QuadPart < sizeof(replay_magic) - 1 || (unsigned long long)size.QuadPart > (size_t)-1) {
+				THROW_ERROR("Not a replay_t log");
+				return;
+			}
+
+			mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			view_ = mapping_ != nullptr ? static_cast<const char *>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+			if(view_ == nullptr) {
+				THROW_LAST_ERROR("Mapping the replay_t log failed");
+				return;
+			}
+			if(memcmp(view_, replay_magic, sizeof(replay_magic) - 1) != 0) {
+				THROW_ERROR("Not a replay_t log");
+				return;
+			}
+
+			const char *p = view_ + sizeof(replay_magic) - 1;
+			const char *end = view_ + (size_t)size.QuadPart;
+			while((size_t)(end - p) >= sizeof(replay_record_t)) {
+				replay_record_t record;
+				memcpy(&record, p, sizeof(record));
+				p += sizeof(record);
+				size_t left = (size_t)(end - p);
+				if(record.key_length > left || record.headers_length > left - record.key_length ||
+					record.body_length > left - record.key_length - record.headers_length) {
+					// A recording that was cut short; everything before it is still good
+					break;
+				}
+
+				entry_t entry;
+				entry.status = record.status;
+				entry.elapsed = record.elapsed;
+				entry.headers = p + record.key_length;
+				entry.headers_length = record.headers_length;
+				entry.body = entry.headers + record.headers_length;
+				entry.body_length = record.body_length;
+				index_[std::string(p, record.key_length)].push_back(entry);
+				p = entry.body + (size_t)record.body_length;
+				++entries_;
+			}
+		}
+
+		replay_t::~replay_t()
+		{
+			if(view_ != nullptr) {
+				UnmapViewOfFile(view_);
+			}
+			if(mapping_ != nullptr) {
+				CloseHandle(mapping_);
+			}
+			if(file_ != INVALID_HANDLE_VALUE) {
+				CloseHandle(file_);
+			}
+		}
+
+		size_t replay_t::size() const
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			return entries_;
+		}
+
+		bool replay_t::record(const std::string &key, int status, const std::string &headers, const std::string &body, unsigned int elapsed)
+		{
+			replay_record_t record;
+			record.key_length = (unsigned int)key.length();
+			record.status = status;
+			record.elapsed = elapsed;
+			record.headers_length = (unsigned int)headers.length();
+			record.body_length = body.length();
+
+			std::lock_guard<std::mutex> lock(mutex_);
+			if(file_ == INVALID_HANDLE_VALUE) {
+				return false;
+			}
+			DWORD written = 0;
+			if(!WriteFile(file_, &record, sizeof(record), &written, nullptr) ||
+				!WriteFile(file_, key.data(), (DWORD)key.length(), &written, nullptr) ||
+				!WriteFile(file_, headers.data(), (DWORD)headers.length(), &written, nullptr) ||
+				!WriteFile(file_, body.data(), (DWORD)body.length(), &written, nullptr)) {
+				return false;
+			}
+			++entries_;
+			return true;
+		}
+
+		bool replay_t::play(const std::string &key, entry_t &entry)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			auto found = index_.find(key);
+			if(found == index_.end()) {
+				return false;
 			}
+			// Starts over once every recording of the exchange has been played, so a benchmark can loop on a short log
+			size_t &cursor = cursors_[key];
+			entry = found->second[cursor % found->second.size()];
+			++cursor;
 			return true;
 		}
 
@@ -27,18 +27,26 @@
 
 #include <string>
 #include <iostream>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <vector>
 
+#ifdef WH_USE_PMR
+#include <memory_resource>
+#endif
+
 #if _HAS_EXCEPTIONS
 
 #include <stdexcept>
-#define THROW_LAST_ERROR(x) { last_error_t e(x); error_ = e.what(); ok_ = false; throw e; }
-#define THROW_ERROR(x) { std::runtime_error e(x); error_ = e.what(); ok_ = false; throw e; }
+#define THROW_LAST_ERROR(x) { set_error(x, GetLastError()); if(throws_) throw last_error_t(phase_, code_); }
+#define THROW_ERROR(x) { set_error(x); if(throws_) throw std::runtime_error(error_handler_t::error()); }
 
 #else
 
-#define THROW_LAST_ERROR(x) { error_ = format_last_error(x); ok_ = false; }
-#define THROW_ERROR(x) { error_ = x; ok_ = false; }
+#define THROW_LAST_ERROR(x) { set_error(x, GetLastError()); }
+#define THROW_ERROR(x) { set_error(x); }
 
 #endif
 
@@ -49,8 +57,86 @@ namespace http
 
 		class request_t;
 		class response_t;
+		class websocket_t;
+		struct download_state_t;
+		struct core_traits_t;
+		class flight_scope_t;
+		class limiter_slot_t;
+		class scheduler_slot_t;
+
+
+		// Where request_t and response_t take their memory from. Same shape as std::pmr::memory_resource, which
+		// this compiler does not have; derive from it to plug in an arena or a pool.
+		class memory_resource_t
+		{
+		public:
+			virtual ~memory_resource_t() {}
+			inline void *allocate(size_t bytes, size_t alignment) { return do_allocate(bytes, alignment); }
+			inline void deallocate(void *p, size_t bytes, size_t alignment) { do_deallocate(p, bytes, alignment); }
+			inline bool is_equal(const memory_resource_t &other) const { return this == &other || do_is_equal(other); }
+
+		protected:
+			virtual void *do_allocate(size_t bytes, size_t alignment) = 0;
+			virtual void do_deallocate(void *p, size_t bytes, size_t alignment) = 0;
+			virtual bool do_is_equal(const memory_resource_t &other) const { return this == &other; }
+		};
+
+		// operator new/delete
+		memory_resource_t *default_resource();
+
+
+#ifdef WH_USE_PMR
+		// Forwards to a std::pmr resource, e.g. the per-RPC monotonic_buffer_resource
+		class pmr_resource_t : public memory_resource_t
+		{
+		public:
+			pmr_resource_t(std::pmr::memory_resource *upstream) : upstream_(upstream) {}
+
+		protected:
+			virtual void *do_allocate(size_t bytes, size_t alignment) { return upstream_->allocate(bytes, alignment); }
+			virtual void do_deallocate(void *p, size_t bytes, size_t alignment) { upstream_->deallocate(p, bytes, alignment); }
+
+		private:
+			std::pmr::memory_resource *upstream_;
+		};
+#endif
 
 
+		template <class T>
+		class allocator_t
+		{
+		public:
+			typedef T value_type;
+			typedef T *pointer;
+			typedef const T *const_pointer;
+			typedef T &reference;
+			typedef const T &const_reference;
+			typedef size_t size_type;
+			typedef ptrdiff_t difference_type;
+			template <class U> struct rebind { typedef allocator_t<U> other; };
+
+			allocator_t(memory_resource_t *resource = nullptr) : resource_(resource != nullptr ? resource : default_resource()) {}
+			template <class U> allocator_t(const allocator_t<U> &other) : resource_(other.resource()) {}
+			inline T *allocate(size_t count) { return static_cast<T *>(resource_->allocate(count * sizeof(T), __alignof(T))); }
+			inline void deallocate(T *p, size_t count) { resource_->deallocate(p, count * sizeof(T), __alignof(T)); }
+			inline size_t max_size() const { return ((size_t)-1) / sizeof(T); }
+			inline memory_resource_t *resource() const { return resource_; }
+
+		private:
+			memory_resource_t *resource_;
+		};
+
+		template <class T, class U>
+		inline bool operator==(const allocator_t<T> &a, const allocator_t<U> &b) { return a.resource()->is_equal(*b.resource()); }
+		template <class T, class U>
+		inline bool operator!=(const allocator_t<T> &a, const allocator_t<U> &b) { return !(a == b); }
+
+		typedef std::basic_string<char, std::char_traits<char>, allocator_t<char> > byte_string_t;
+		typedef std::basic_string<wchar_t, std::char_traits<wchar_t>, allocator_t<wchar_t> > wide_string_t;
+		typedef std::vector<wide_string_t, allocator_t<wide_string_t> > header_list_t;
+
+
+		std::string format_error(const char *phase, DWORD code);
 		std::string format_last_error(const std::string &msg);
 
 
@@ -58,7 +144,13 @@ namespace http
 		class last_error_t : public std::runtime_error
 		{
 		public:
-			last_error_t(const char *msg) : std::runtime_error(format_last_error(msg)) {}
+			last_error_t(const char *msg, DWORD code = GetLastError()) : std::runtime_error(msg), code_(code) {}
+			inline DWORD code() const { return code_; }
+			virtual const char *what() const throw();
+
+		private:
+			DWORD code_;
+			mutable std::string message_;
 		};
 #endif
 
@@ -67,7 +159,49 @@ namespace http
 		{
 			option_allow_unknown_cert_authority = 0,
 			option_allow_invalid_cert_name,
-			option_allow_invalid_cert_date
+			option_allow_invalid_cert_date,
+			option_enable_http2
+		};
+
+
+		enum digest_algorithm_t
+		{
+			digest_none = 0,
+			digest_crc32c,
+			digest_xxhash64,
+			digest_sha256,
+			digest_md5
+		};
+
+
+		// Incremental checksum or hash; finish() returns the raw value, big-endian for the checksums
+		class digest_t
+		{
+		public:
+			digest_t(digest_algorithm_t algorithm = digest_none);
+			digest_t(const digest_t &other) = delete;
+			~digest_t();
+			inline digest_algorithm_t algorithm() const { return algorithm_; }
+			void update(const void *data, size_t length);
+			std::string finish();
+
+		private:
+			digest_algorithm_t algorithm_;
+			unsigned int crc_;
+			unsigned long long lanes_[4];
+			unsigned char stripe_[32];
+			size_t stripe_length_;
+			unsigned long long total_;
+			void *hash_;
+			std::vector<unsigned char> object_;
+		};
+
+
+		enum priority_t
+		{
+			priority_background = 0,
+			priority_normal,
+			priority_interactive
 		};
 
 
@@ -89,15 +223,265 @@ namespace http
 
 		class error_handler_t
 		{
+			friend struct core_traits_t;
+
 		public:
-			error_handler_t() : ok_(true) {}
+			error_handler_t(bool throws = true) : ok_(true), throws_(throws), phase_(nullptr), code_(0), formatted_(true) {}
 			virtual ~error_handler_t() {}
 			inline bool ok() const { return ok_; }
-			inline const std::string &error() const { return error_; }
+			inline const char *phase() const { return phase_; }
+			inline DWORD code() const { return code_; }
+			const std::string &error() const;
+
+		protected:
+			// phase must be a string literal; the message is only built if somebody asks for it
+			inline void set_error(const char *phase, DWORD code = 0) { ok_ = false; phase_ = phase; code_ = code; formatted_ = false; }
+			inline void set_error(const std::string &message) { ok_ = false; phase_ = nullptr; code_ = 0; error_ = message; formatted_ = true; }
+			inline void clear_error() { ok_ = true; phase_ = nullptr; code_ = 0; error_.clear(); formatted_ = true; }
+			void take_error(const error_handler_t &other);
 
 		protected:
 			bool ok_;
-			std::string error_;
+			bool throws_;
+			const char *phase_;
+			DWORD code_;
+			mutable bool formatted_;
+			mutable std::string error_;
+		};
+
+
+		class cancel_t
+		{
+			friend class connection_t;
+			friend class response_t;
+			friend class cancel_scope_t;
+
+		public:
+			cancel_t();
+			cancel_t(const cancel_t &other) = delete;
+			void cancel();
+			bool cancelled() const;
+
+		private:
+			bool attach(HINTERNET h);
+			bool detach();
+
+		private:
+			mutable std::mutex mutex_;
+			HINTERNET handle_;
+			bool cancelled_;
+			bool closed_;
+		};
+
+
+		class retry_budget_t
+		{
+		public:
+			retry_budget_t(double ratio = 0.1, double min_per_second = 10.0);
+			retry_budget_t(const retry_budget_t &other) = delete;
+			void deposit();
+			bool withdraw();
+
+		private:
+			void refill();
+
+		private:
+			std::mutex mutex_;
+			double ratio_;
+			double min_per_second_;
+			double max_tokens_;
+			double tokens_;
+			unsigned long long last_refill_;
+		};
+
+
+		class policy_t
+		{
+		public:
+			policy_t();
+			inline bool hedging() const { return hedging_; }
+			inline double hedge_quantile() const { return hedge_quantile_; }
+			inline unsigned int hedge_min_delay() const { return hedge_min_delay_; }
+			inline unsigned int max_retries() const { return max_retries_; }
+			inline unsigned int backoff_base() const { return backoff_base_; }
+			inline unsigned int backoff_cap() const { return backoff_cap_; }
+			inline retry_budget_t &budget() { return budget_; }
+			inline void set_hedging(bool on) { hedging_ = on; }
+			inline void set_hedge_quantile(double quantile) { hedge_quantile_ = quantile; }
+			inline void set_hedge_min_delay(unsigned int milliseconds) { hedge_min_delay_ = milliseconds; }
+			inline void set_max_retries(unsigned int count) { max_retries_ = count; }
+			inline void set_backoff(unsigned int base_milliseconds, unsigned int cap_milliseconds) { backoff_base_ = base_milliseconds; backoff_cap_ = cap_milliseconds; }
+
+		private:
+			bool hedging_;
+			double hedge_quantile_;
+			unsigned int hedge_min_delay_;
+			unsigned int max_retries_;
+			unsigned int backoff_base_;
+			unsigned int backoff_cap_;
+			retry_budget_t budget_;
+		};
+
+
+		class limiter_t
+		{
+			friend class limiter_slot_t;
+
+		public:
+			limiter_t(unsigned int initial_limit = 20, unsigned int min_limit = 1, unsigned int max_limit = 200);
+			limiter_t(const limiter_t &other) = delete;
+			unsigned int limit(const std::string &host) const;
+			void set_rate(double requests_per_second, double burst);
+			inline void set_tolerance(double tolerance) { tolerance_ = tolerance; }
+			inline void set_queue_timeout(unsigned int milliseconds) { queue_timeout_ = milliseconds; }
+
+		private:
+			bool acquire(const std::string &host);
+			void release(const std::string &host, unsigned int microseconds, bool succeeded);
+
+		private:
+			struct host_t
+			{
+				host_t() : in_flight(0), limit(0.0), baseline(0.0), tokens(0.0), last_refill(0) {}
+				unsigned int in_flight;
+				double limit;
+				double baseline;
+				double tokens;
+				unsigned long long last_refill;
+			};
+
+			mutable std::mutex mutex_;
+			std::condition_variable available_;
+			std::map<std::string, host_t> hosts_;
+			unsigned int initial_limit_;
+			unsigned int min_limit_;
+			unsigned int max_limit_;
+			double tolerance_;
+			double rate_;
+			double burst_;
+			unsigned int queue_timeout_;
+		};
+
+
+		// Orders requests from every connection it is set on by priority before they reach the session's connection
+		// pool. Waiting requests climb one class per aging interval so background work is delayed, never starved,
+		// and the last reserved slots are only ever handed to priority_interactive requests.
+		class scheduler_t
+		{
+			friend class scheduler_slot_t;
+
+		public:
+			scheduler_t(unsigned int slots = 32, unsigned int reserved = 4, unsigned int aging = 500);
+			scheduler_t(const scheduler_t &other) = delete;
+			unsigned int in_flight() const;
+			unsigned int waiting() const;
+			inline void set_queue_timeout(unsigned int milliseconds) { queue_timeout_ = milliseconds; }
+
+		private:
+			struct waiter_t
+			{
+				unsigned long long ticket;
+				priority_t priority;
+				unsigned long long enqueued;
+				bool granted;
+			};
+
+			bool acquire(priority_t priority, unsigned long long deadline);
+			void release();
+			void grant();
+			bool admits(priority_t priority) const;
+
+		private:
+			mutable std::mutex mutex_;
+			std::condition_variable changed_;
+			std::vector<waiter_t *> waiting_;
+			unsigned int slots_;
+			unsigned int reserved_;
+			unsigned int aging_;
+			unsigned int in_flight_;
+			unsigned long long next_ticket_;
+			unsigned int queue_timeout_;
+		};
+
+
+		class cache_t
+		{
+			friend class connection_t;
+
+		public:
+			cache_t(size_t max_bytes, const std::string &directory = std::string(), unsigned int shards = 8);
+			cache_t(const cache_t &other) = delete;
+			~cache_t();
+			void clear();
+			size_t size() const;
+
+		private:
+			struct entry_t;
+			struct shard_t;
+
+			shard_t &shard_for(const std::string &key) const;
+			std::shared_ptr<entry_t> lookup(const std::string &key);
+			void store(const std::shared_ptr<entry_t> &entry, bool persist = true);
+			void erase(const std::string &key);
+			std::string disk_path(const std::string &key) const;
+			std::shared_ptr<entry_t> load(const std::string &key) const;
+			void save(const entry_t &entry) const;
+
+		private:
+			std::vector<std::unique_ptr<shard_t>> shards_;
+			size_t shard_max_bytes_;
+			std::string directory_;
+		};
+
+
+		// Records real exchanges to a binary log, or plays one back in place of the network for offline, repeatable
+		// runs. It sits under the cache, policy and coalescing, which behave on top of it as they would on the wire.
+		// Exchanges are matched on method, target and body; repeats of one are played back in recorded order.
+		class replay_t : public error_handler_t
+		{
+			friend class connection_t;
+
+		public:
+			enum mode_t
+			{
+				mode_record,
+				mode_replay
+			};
+
+			replay_t(const std::string &path, mode_t mode);
+			replay_t(const replay_t &other) = delete;
+			~replay_t();
+			inline mode_t mode() const { return mode_; }
+			// Played back exchanges take as long as the recorded ones did, or come back at once when off
+			inline void set_timed(bool timed) { timed_ = timed; }
+			size_t size() const;
+
+		private:
+			struct entry_t
+			{
+				int status;
+				unsigned int elapsed;
+				const char *headers;
+				size_t headers_length;
+				const char *body;
+				unsigned long long body_length;
+			};
+
+			static const size_t max_body_size = 64 * 1024 * 1024;
+
+			bool record(const std::string &key, int status, const std::string &headers, const std::string &body, unsigned int elapsed);
+			bool play(const std::string &key, entry_t &entry);
+
+		private:
+			mode_t mode_;
+			bool timed_;
+			mutable std::mutex mutex_;
+			HANDLE file_;
+			HANDLE mapping_;
+			const char *view_;
+			size_t entries_;
+			std::map<std::string, std::vector<entry_t> > index_;
+			std::map<std::string, size_t> cursors_;
 		};
 
 
@@ -106,6 +490,63 @@ namespace http
 		public:
 			session_t(const std::string &user_agent);
 			~session_t();
+			// Looks host up through the DNS client, IPv6 first. There is no cache here: the lookup primes the system
+			// cache WinHTTP resolves against, which is all prewarm() wants from it.
+			bool resolve(const std::string &host, std::vector<std::string> &addresses) const;
+			void record_latency(const std::string &host, unsigned int microseconds) const;
+			bool latency_quantile(const std::string &host, double quantile, unsigned int &microseconds) const;
+			// Pooled objects keep their allocations between uses; the session must outlive anything it hands out
+			request_t acquire_request(const std::string &method, const std::string &url) const;
+			void recycle(request_t &&req) const;
+			void recycle(response_t &&resp) const;
+			size_t pooled_requests() const;
+			size_t pooled_buffers() const;
+			// Identical concurrent GET/HEAD requests then share one upstream exchange and its buffered response.
+			// headers names the request headers that make two requests different, e.g. Authorization or Accept.
+			// Only responses with a Content-Length up to max_body are shared; streams go to the first caller alone.
+			void set_coalescing(bool on, const std::vector<std::string> &headers = std::vector<std::string>(), size_t max_body = 8 * 1024 * 1024);
+			// Socket tuning, taken up by every connection the session opens. Invalid values and options the
+			// system lacks fail like any other call; Nagle and socket buffer sizes are left to WinHTTP.
+			bool set_tcp_fast_open(bool on);
+			bool set_keepalive(bool on, unsigned int idle_ms = 30000, unsigned int interval_ms = 1000);
+			bool set_max_connections(unsigned int per_server);
+			// Size of the buffer responses read into, between 4K and 16M
+			bool set_read_chunk_size(size_t bytes);
+			size_t read_chunk_size() const;
+
+		private:
+			friend class response_t;
+			friend class connection_t;
+			friend class flight_scope_t;
+
+			struct flight_t;
+
+			static const size_t latency_window_size = 512;
+			static const size_t request_pool_size = 64;
+			static const size_t buffer_pool_size = 8;
+			static const size_t min_read_chunk_size = 4 * 1024;
+			static const size_t max_read_chunk_size = 16 * 1024 * 1024;
+
+			char *acquire_buffer(size_t &size) const;
+
+			struct latency_window_t
+			{
+				latency_window_t() : next(0) {}
+				std::vector<unsigned int> samples;
+				size_t next;
+			};
+
+			mutable std::mutex latency_mutex_;
+			mutable std::map<std::string, latency_window_t> latencies_;
+			mutable std::mutex pool_mutex_;
+			mutable std::vector<request_t> requests_;
+			mutable std::vector<char *> buffers_;
+			size_t read_chunk_size_;
+			bool coalescing_;
+			std::vector<std::string> coalesce_headers_;
+			size_t coalesce_max_body_;
+			mutable std::mutex flights_mutex_;
+			mutable std::map<std::string, std::shared_ptr<flight_t> > flights_;
 		};
 
 
@@ -115,64 +556,232 @@ namespace http
 			connection_t(const session_t &sess, const std::string &host);
 			virtual ~connection_t();
 			response_t send(const request_t &req);
+			response_t try_send(const request_t &req);
+			bool download(const std::string &url, const std::string &path, unsigned int segments = 4, bool resumable = false);
+			// Opens up to count sockets to the host with OPTIONS * requests that skip replay, cache, coalescing, policy and
+			// limits; returns how many answered
+			unsigned int prewarm(unsigned int count);
+#ifndef WH_USE_WININET
+			websocket_t upgrade_websocket(const request_t &req);
+#endif
 			unsigned int flags() const { return flags_; }
 			inline unsigned int timeout() const { return timeout_; }
 			void set_option(option_t opt, bool on);
 			inline void set_timeout(unsigned int seconds) { timeout_ = seconds; }
+			inline void set_cache(cache_t *cache) { cache_ = cache; }
+			inline void set_policy(policy_t *policy) { policy_ = policy; }
+			inline void set_limiter(limiter_t *limiter) { limiter_ = limiter; }
+			inline void set_scheduler(scheduler_t *scheduler) { scheduler_ = scheduler; }
+			inline void set_replay(replay_t *replay) { replay_ = replay; }
 
 		private:
+			static const unsigned int max_prewarm_threads = 8;
+
+			void inherit_settings(const connection_t &other);
+			std::string authority() const;
+			std::string target(const request_t &req) const;
+			response_t transmit(const request_t &req, cancel_t *cancel = nullptr);
+			response_t send_direct(const request_t &req);
+			response_t send_coalesced(const request_t &req);
+			response_t dispatch(const request_t &req);
+			response_t send_cached(const request_t &req);
+			response_t send_with_policy(const request_t &req);
+			response_t hedged_attempt(const request_t &req, std::string &error, const char *&phase, DWORD &code);
+			void download_worker(const std::string &url, download_state_t &state) const;
+			bool download_range(const std::string &url, download_state_t &state, unsigned long long first, unsigned long long last, std::string &error) const;
+
+		private:
+			const session_t &session_;
+			std::string origin_;
 			std::wstring host_;
 			URL_COMPONENTSW components_;
 			unsigned int flags_;
 			unsigned int timeout_;
+			cache_t *cache_;
+			policy_t *policy_;
+			limiter_t *limiter_;
+			scheduler_t *scheduler_;
+			replay_t *replay_;
 		};
 
 
 		class request_t
 		{
 			friend class connection_t;
+			friend struct core_traits_t;
 
 		public:
-			request_t(const std::string &method, const std::string &url);
+			request_t(const std::string &method, const std::string &url, memory_resource_t *resource = nullptr);
+			request_t(const request_t &other);
+			request_t(request_t &&other);
 			virtual ~request_t();
-			inline void set_body(const std::string &body) { body_ = body; }
-			inline void set_body(const char *data, size_t length) { body_.clear(); body_.append(data, length); }
+			request_t &operator=(const request_t &other);
+			request_t &operator=(request_t &&other);
+			void reset(const std::string &method, const std::string &url);
+			inline memory_resource_t *resource() const { return body_.get_allocator().resource(); }
+			inline void set_body(const std::string &body) { body_.assign(body.data(), body.length()); }
+			inline void set_body(const char *data, size_t length) { body_.assign(data, length); }
 			void add_header(const std::string &line);
+			bool header(const std::string &name, std::string &value) const;
 			void set_option(option_t opt, bool on);
+			inline unsigned long long deadline() const { return deadline_; }
+			inline void set_deadline(unsigned long long tick) { deadline_ = tick; }
+			void set_timeout(unsigned int milliseconds);
+			inline priority_t priority() const { return priority_; }
+			inline void set_priority(priority_t priority) { priority_ = priority; }
+			// Hashes the outgoing body into a Content-MD5/Repr-Digest/x-goog-hash header and the response body as it is read
+			inline digest_algorithm_t digest() const { return digest_; }
+			inline void set_digest(digest_algorithm_t algorithm) { digest_ = algorithm; }
 
 		private:
-			std::wstring method_;
-			std::wstring url_;
-			std::string body_;
-			std::vector<std::wstring> additional_headers_;
+			wide_string_t method_;
+			wide_string_t url_;
+			byte_string_t body_;
+			header_list_t additional_headers_;
 			unsigned int flags_;
+			unsigned long long deadline_;
+			priority_t priority_;
+			digest_algorithm_t digest_;
 		};
 
 
 		class response_t : public handle_manage_t, public error_handler_t
 		{
 			friend class connection_t;
+			friend class session_t;
 
 		private:
-			static const int read_buffer_size = 1024 * 1024;
+			static const size_t default_read_chunk_size = 1024 * 1024;
 
 		private:
-			response_t(HINTERNET request_t);
+			response_t(HINTERNET request_t, cancel_t *cancel = nullptr, unsigned long long deadline = 0, DWORD timeout = 0);
+			response_t(int status, const std::string &headers, const std::shared_ptr<const std::string> &body, bool throws);
+			bool arm_receive_timeout();
+			bool raw_headers(std::string &out) const;
+			bool buffer_body(size_t limit);
+			void release_buffer();
+			// The scheduler and limiter slots are held until the body has been read to its end, or the read failed
+			void end_exchange();
 
 		public:
+			response_t();
 			response_t(const response_t &other) = delete;
 			response_t(response_t &&other);
 			virtual ~response_t();
 			inline const response_t &operator=(const response_t &other) = delete;
-			inline const response_t &operator=(const response_t &&other) = delete;
+			response_t &operator=(response_t &&other);
+			void reset();
 			inline int status() const { return status_; }
 			inline bool succeeded() const { return status_ >= 200 && status_ < 300; }
 			inline bool failed() const { return !succeeded(); }
+			bool http2() const;
+			bool header(const std::string &name, std::string &value) const;
 			bool read(std::ostream &out);
+			bool read(char *buffer, size_t count, size_t *bytes_read);
+			// Returns as soon as any bytes arrive rather than when buffer is full; 0 bytes means the body has ended
+			bool read_some(char *buffer, size_t count, size_t *bytes_read);
+			// Lowercase hex of the body read off the wire with the algorithm the request asked for, once the body is read.
+			// Empty for responses served from cache_t or shared by coalescing, which never touch the wire.
+			const std::string &digest();
+			// Compares the digest with Content-MD5, Repr-Digest/Digest, x-goog-hash or a hex ETag; false if none apply
+			bool verify_digest();
 
 		private:
 			char *buffer_;
+			size_t buffer_size_;
 			int status_;
+			std::string headers_;
+			std::shared_ptr<const std::string> body_;
+			size_t body_offset_;
+			unsigned long long deadline_;
+			DWORD timeout_;
+			const session_t *pool_;
+			memory_resource_t *resource_;
+			std::unique_ptr<digest_t> digest_;
+			std::string digest_value_;
+			std::string digest_raw_;
+			std::unique_ptr<scheduler_slot_t> scheduled_;
+			std::unique_ptr<limiter_slot_t> limited_;
+		};
+
+
+#ifndef WH_USE_WININET
+		// A client websocket on top of WinHTTP (Windows 8 and later). WinHTTP does the framing and masking.
+		class websocket_t : public handle_manage_t, public error_handler_t
+		{
+			friend class connection_t;
+
+		public:
+			enum message_type_t
+			{
+				message_binary,
+				message_text,
+				message_close
+			};
+
+		private:
+			websocket_t(HINTERNET socket, bool throws, const error_handler_t &origin);
+
+		public:
+			websocket_t(const websocket_t &other) = delete;
+			websocket_t(websocket_t &&other);
+			virtual ~websocket_t();
+			inline const websocket_t &operator=(const websocket_t &other) = delete;
+			bool send(const char *data, size_t length, message_type_t type = message_binary);
+			inline bool send(const std::string &message, message_type_t type = message_text) { return send(message.data(), message.length(), type); }
+			// Streams one message in pieces; the last piece has final set
+			bool send_fragment(const char *data, size_t length, message_type_t type, bool final);
+			// Reassembles fragments straight into message; a close from the server comes back as message_close
+			bool receive(std::string &message, message_type_t &type);
+			bool close(unsigned short status = 1000, const std::string &reason = std::string());
+			inline unsigned short close_status() const { return close_status_; }
+			inline const std::string &close_reason() const { return close_reason_; }
+
+		private:
+			bool query_close_status();
+
+		private:
+			unsigned short close_status_;
+			std::string close_reason_;
+		};
+#endif
+
+
+		// Splits a long-lived response into newline-delimited records (NDJSON) or Server-Sent Events as the bytes
+		// arrive. Records are cut out of one reused buffer, which only grows when a single record outgrows it.
+		class stream_reader_t
+		{
+		public:
+			struct event_t
+			{
+				event_t() : retry(0) {}
+				std::string type;
+				std::string data;
+				std::string id;
+				unsigned int retry;
+			};
+
+			stream_reader_t(response_t &resp, size_t capacity = 64 * 1024);
+			stream_reader_t(const stream_reader_t &other) = delete;
+			// Next non-blank line without its terminator; false once the body has ended or the read failed (see response ok())
+			bool next_line(std::string &line);
+			// The next dispatched event (WHATWG HTML, 9.2.6); comments and empty events are skipped
+			bool next_event(event_t &event);
+			inline const std::string &last_event_id() const { return last_event_id_; }
+
+		private:
+			bool fill();
+			bool line(const char *&begin, const char *&end);
+
+		private:
+			response_t &resp_;
+			std::vector<char> buffer_;
+			size_t begin_;
+			size_t end_;
+			size_t scanned_;
+			bool eof_;
+			bool started_;
+			std::string last_event_id_;
 		};
 
 	} // namespace stl